@@ -0,0 +1,308 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "zlib.h"
+#include "bgzf.h"
+
+// Largest amount of data we put in one block, leaving room for deflate to
+// expand incompressible data without overflowing the 64 KB limit.
+static const size_t BGZF_MAX_DATA_SIZE = 0xff00;
+
+// gzip header with the FEXTRA flag and a "BC" subfield of length 2, which
+// holds the total block size minus 1.
+static const unsigned char BGZF_HEADER[18] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0
+};
+
+// An empty block marks the end of the file.
+static const unsigned char BGZF_EOF[28] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0,
+    3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static inline uint16_t read_u16(const unsigned char * p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t read_u32(const unsigned char * p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void write_u32(unsigned char * p, uint32_t x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+// Return the total block size from the extra field, or 0 if there is no
+// "BC" subfield.
+static size_t bgzf_block_size(const unsigned char * extra, size_t xlen)
+{
+    size_t i = 0;
+    while (i + 4 <= xlen) {
+        size_t slen = read_u16(extra + i + 2);
+        if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2
+            && i + 6 <= xlen) {
+            return read_u16(extra + i + 4) + 1;
+        }
+        i += 4 + slen;
+    }
+    return 0;
+}
+
+bool is_bgzf(const std::string & filename)
+{
+    FILE * file = fopen(filename.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    unsigned char header[18];
+    size_t n = fread(header, 1, sizeof(header), file);
+    fclose(file);
+    if (n != sizeof(header) || header[0] != 31 || header[1] != 139
+        || header[2] != 8 || (header[3] & 4) == 0
+        || read_u16(header + 10) < 6) {
+        return false;
+    }
+    // bgzip always writes the "BC" subfield first.
+    return bgzf_block_size(header + 12, 6) > 0;
+}
+
+bool bgzf_read_block(FILE * file, std::string & block)
+{
+    unsigned char header[12];
+    size_t n = fread(header, 1, sizeof(header), file);
+    if (n == 0) {
+        return false;
+    }
+    if (n != sizeof(header) || header[0] != 31 || header[1] != 139
+        || (header[3] & 4) == 0) {
+        std::cerr << "ERROR: Malformed BGZF block header" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t xlen = read_u16(header + 10);
+    unsigned char extra[BGZF_MAX_BLOCK_SIZE];
+    if (fread(extra, 1, xlen, file) != xlen) {
+        std::cerr << "ERROR: Truncated BGZF block header" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t size = bgzf_block_size(extra, xlen);
+    if (size < sizeof(header) + xlen + 8) {
+        std::cerr << "ERROR: Not a BGZF block" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    block.resize(size);
+    memcpy(&block[0], header, sizeof(header));
+    memcpy(&block[sizeof(header)], extra, xlen);
+    size_t rest = size - sizeof(header) - xlen;
+    if (fread(&block[sizeof(header) + xlen], 1, rest, file) != rest) {
+        std::cerr << "ERROR: Truncated BGZF block" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+bool bgzf_inflate_block(const std::string & block, std::string & data)
+{
+    const unsigned char * p = (const unsigned char *) block.data();
+    size_t xlen = read_u16(p + 10);
+    size_t start = 12 + xlen;
+    if (block.size() < start + 8) {
+        return false;
+    }
+    uint32_t crc = read_u32(p + block.size() - 8);
+    uint32_t isize = read_u32(p + block.size() - 4);
+    data.resize(isize);
+    if (isize == 0) {
+        return true;
+    }
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // Negative window bits: raw deflate data without a zlib header.
+    if (inflateInit2(&z, -15) != Z_OK) {
+        return false;
+    }
+    z.next_in = (Bytef *) p + start;
+    z.avail_in = block.size() - start - 8;
+    z.next_out = (Bytef *) &data[0];
+    z.avail_out = isize;
+    int status = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    if (status != Z_STREAM_END || z.total_out != isize) {
+        return false;
+    }
+    return crc32(crc32(0L, Z_NULL, 0), (const Bytef *) data.data(), isize)
+           == crc;
+}
+
+bool BGZFWriter::open(const std::string & filename)
+{
+    close();
+    _file = fopen(filename.c_str(), "wb");
+    _offset = 0;
+    _data.clear();
+    return _file != NULL;
+}
+
+void BGZFWriter::close()
+{
+    if (_file == NULL) {
+        return;
+    }
+    flush();
+    fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), _file);
+    fclose(_file);
+    _file = NULL;
+}
+
+uint64_t BGZFWriter::write_line(const char * line, size_t length)
+{
+    // Start a new block if this line would not fit in the current one.
+    if (_data.size() + length + 1 > BGZF_MAX_DATA_SIZE) {
+        flush();
+    }
+    uint64_t voffset = tell();
+    // A line longer than a block must span several blocks.
+    while (length + 1 > BGZF_MAX_DATA_SIZE) {
+        _data.assign(line, BGZF_MAX_DATA_SIZE);
+        flush();
+        line += BGZF_MAX_DATA_SIZE;
+        length -= BGZF_MAX_DATA_SIZE;
+    }
+    _data.append(line, length);
+    _data.push_back('\n');
+    return voffset;
+}
+
+void BGZFWriter::flush()
+{
+    if (_data.size() == 0) {
+        return;
+    }
+    unsigned char block[BGZF_MAX_BLOCK_SIZE];
+    memcpy(block, BGZF_HEADER, sizeof(BGZF_HEADER));
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        std::cerr << "ERROR: Cannot initialize zlib" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    z.next_in = (Bytef *) _data.data();
+    z.avail_in = _data.size();
+    z.next_out = block + sizeof(BGZF_HEADER);
+    z.avail_out = sizeof(block) - sizeof(BGZF_HEADER) - 8;
+    int status = deflate(&z, Z_FINISH);
+    deflateEnd(&z);
+    if (status != Z_STREAM_END) {
+        std::cerr << "ERROR: BGZF block overflow" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    size_t size = sizeof(BGZF_HEADER) + z.total_out + 8;
+    block[16] = (size - 1) & 0xff;
+    block[17] = (size - 1) >> 8;
+    uLong crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *) _data.data(),
+                      _data.size());
+    write_u32(block + size - 8, crc);
+    write_u32(block + size - 4, _data.size());
+
+    if (fwrite(block, 1, size, _file) != size) {
+        std::cerr << "ERROR: Cannot write BGZF block" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    _offset += size;
+    _data.clear();
+}
+
+bool BGZFReader::open(const std::string & filename)
+{
+    close();
+    _file = fopen(filename.c_str(), "rb");
+    _offset = _next_offset = 0;
+    _data.clear();
+    _pos = 0;
+    return _file != NULL;
+}
+
+void BGZFReader::close()
+{
+    if (_file != NULL) {
+        fclose(_file);
+        _file = NULL;
+    }
+}
+
+bool BGZFReader::next_block()
+{
+    if (fseeko(_file, _next_offset, SEEK_SET) != 0
+        || !bgzf_read_block(_file, _block)) {
+        return false;
+    }
+    if (!bgzf_inflate_block(_block, _data)) {
+        std::cerr << "ERROR: Corrupt BGZF block at offset "
+                  << _next_offset << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    _offset = _next_offset;
+    _next_offset += _block.size();
+    _pos = 0;
+    return true;
+}
+
+bool BGZFReader::seek(uint64_t voffset)
+{
+    uint64_t offset = voffset >> 16;
+    size_t pos = voffset & 0xffff;
+    // Reuse the current block if we can.
+    if (offset != _offset || _data.size() == 0) {
+        _next_offset = offset;
+        if (!next_block()) {
+            return false;
+        }
+    }
+    if (pos > _data.size()) {
+        return false;
+    }
+    _pos = pos;
+    return true;
+}
+
+uint64_t BGZFReader::tell()
+{
+    // Skip past the end of this block and any empty ones.
+    while (_pos == _data.size() && next_block()) {
+    }
+    return (_offset << 16) | _pos;
+}
+
+bool BGZFReader::getline(std::string & line)
+{
+    line.clear();
+    bool found = false;
+    while (true) {
+        if (_pos == _data.size()) {
+            if (!next_block()) {
+                return found;
+            }
+            continue;
+        }
+        found = true;
+        size_t end = _data.find('\n', _pos);
+        if (end != std::string::npos) {
+            line.append(_data, _pos, end - _pos);
+            _pos = end + 1;
+            return true;
+        }
+        // The line continues in the next block.
+        line.append(_data, _pos, std::string::npos);
+        _pos = _data.size();
+    }
+}
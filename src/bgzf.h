@@ -0,0 +1,98 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+#ifndef _BGZF_H
+#define _BGZF_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+
+// BGZF (blocked gzip, as used by bgzip and tabix) is a series of gzip
+// members that each hold at most 64 KB of data and record their compressed
+// size in a header field. zlib reads it like any other gzip file, but each
+// block can also be found and inflated on its own.
+//
+// A virtual offset points to a position in the inflated data. The upper 48
+// bits are the file offset of a block, and the lower 16 bits are an offset
+// into the inflated block.
+
+// Maximum size of a block, compressed or inflated.
+const size_t BGZF_MAX_BLOCK_SIZE = 0x10000;
+
+// Return true if the file starts with a BGZF block header.
+bool is_bgzf(const std::string & filename);
+
+// Read the next whole compressed block from the file into the string.
+// Return false at the end of the file. Exit if the block is malformed.
+bool bgzf_read_block(FILE * file, std::string & block);
+
+// Inflate one whole compressed block. Return false if it is corrupt.
+bool bgzf_inflate_block(const std::string & block, std::string & data);
+
+// Write a BGZF file one line at a time. Each line that fits in a block is
+// kept within one block, so it can be read back with a single inflate.
+class BGZFWriter
+{
+public:
+    BGZFWriter() : _file(NULL), _offset(0) {}
+    ~BGZFWriter() { close(); }
+
+    bool open(const std::string & filename);
+
+    // Flush the last block, write the end-of-file marker, and close.
+    void close();
+
+    // Return the virtual offset of the next byte to be written.
+    uint64_t tell() const
+    {
+        return (_offset << 16) | _data.size();
+    }
+
+    // Write a line and a trailing newline. Return the virtual offset where
+    // the line begins.
+    uint64_t write_line(const char * line, size_t length);
+
+private:
+    void flush();
+
+    FILE * _file;
+    // File offset of the block being filled.
+    uint64_t _offset;
+    // Data waiting to be compressed into the next block.
+    std::string _data;
+};
+
+// Read a BGZF file line by line, optionally seeking to virtual offsets.
+class BGZFReader
+{
+public:
+    BGZFReader() : _file(NULL), _offset(0), _next_offset(0), _pos(0) {}
+    ~BGZFReader() { close(); }
+
+    bool open(const std::string & filename);
+    void close();
+
+    // Move to a virtual offset. Return false if it is out of range.
+    bool seek(uint64_t voffset);
+
+    // Return the virtual offset of the next line.
+    uint64_t tell();
+
+    // Read the next line without its newline. Return false at the end of
+    // the file.
+    bool getline(std::string & line);
+
+private:
+    // Read and inflate the block at _next_offset.
+    bool next_block();
+
+    FILE * _file;
+    // File offsets of the current block and the one after it.
+    uint64_t _offset, _next_offset;
+    // The current block and our position in it.
+    std::string _block, _data;
+    size_t _pos;
+};
+
+#endif
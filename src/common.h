@@ -5,16 +5,22 @@
 #define __COMMON_H
 
 #include <algorithm>
+#include <cctype>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <limits>
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
+#include <numeric>
 #include <random>
 #include <set>
 #include <sstream>
+#include <stdint.h>
 #include <string>
 #include <time.h>
 #include <vector>
@@ -83,6 +89,177 @@ struct genomic_interval {
     ulong end;
 };
 
+// 64-bit FNV-1a hash of some bytes. Pass the previous result as the seed to
+// hash data that arrives in pieces.
+inline uint64_t hash_bytes(
+    const char * s,
+    size_t n,
+    uint64_t h = 14695981039346656037ULL
+)
+{
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// 64-bit hash of some bytes that reads them eight at a time, several times
+// faster than hash_bytes() on large buffers. Bytes after the last whole
+// word go to hash_bytes(). Pass the previous result as the seed to hash
+// data that arrives in pieces whose sizes are multiples of eight.
+inline uint64_t hash_words(
+    const char * s,
+    size_t n,
+    uint64_t h = 14695981039346656037ULL
+)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, s + i, 8);
+        h = (h ^ word) * 1099511628211ULL;
+        h ^= h >> 32;
+    }
+    return hash_bytes(s + i, n - i, h);
+}
+
+// Hash the contents of a file with hash_words(), continuing from a previous
+// hash.
+inline uint64_t hash_file(
+    std::string filename,
+    uint64_t h = 14695981039346656037ULL
+)
+{
+    std::ifstream stream(filename.c_str(), std::ios::binary);
+    if (!stream.is_open()) {
+        std::cerr << "ERROR: Cannot open " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::vector<char> buffer(1 << 20);
+    while (stream) {
+        stream.read(&buffer[0], buffer.size());
+        h = hash_words(&buffer[0], stream.gcount(), h);
+    }
+    return h;
+}
+
+// The number of bytes at each end of a file that hash_file_ends() reads.
+const int64_t HASH_FILE_END_BYTES = 1 << 16;
+
+// Hash the size of a file and the bytes at its beginning and end,
+// continuing from a previous hash. This reads at most 128 KiB however large
+// the file is, and a copy of the file has the same hash on any machine. The
+// end of a gzip file holds the CRC of the data in its last member.
+inline uint64_t hash_file_ends(
+    std::string filename,
+    uint64_t h = 14695981039346656037ULL
+)
+{
+    std::ifstream stream(filename.c_str(), std::ios::binary);
+    if (!stream.is_open()) {
+        std::cerr << "ERROR: Cannot open " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    stream.seekg(0, std::ios::end);
+    int64_t size = stream.tellg();
+    h = hash_bytes((const char *) &size, sizeof(size), h);
+
+    std::vector<char> buffer(HASH_FILE_END_BYTES);
+    stream.seekg(0);
+    stream.read(&buffer[0], buffer.size());
+    h = hash_bytes(&buffer[0], stream.gcount(), h);
+    if (size > HASH_FILE_END_BYTES) {
+        stream.clear();
+        stream.seekg(std::max(size - HASH_FILE_END_BYTES,
+                              HASH_FILE_END_BYTES));
+        stream.read(&buffer[0], buffer.size());
+        h = hash_bytes(&buffer[0], stream.gcount(), h);
+    }
+    return h;
+}
+
+// Parse a decimal number at s after skipping spaces and tabs, and point
+// end to the first character after it. Numbers with at most 15 significant
+// digits and a power of ten within 1e22 are exact as doubles, so we convert
+// them with a single multiply or divide (Clinger's fast path). Everything
+// else, including "nan" and "inf", goes to strtod(). The result is the same
+// correctly rounded double either way. Return false if there is no number.
+// Line breaks are never skipped, so a missing value is never read from the
+// next line.
+inline bool parse_double(const char * s, const char ** end, double & x)
+{
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    while (*s == ' ' || *s == '\t') {
+        s++;
+    }
+    const char * p = s;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') {
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool found = false, fast = true;
+    // Leading zeros are not significant digits.
+    for (; *p >= '0' && *p <= '9'; p++) {
+        found = true;
+        if (mantissa > 0 || *p != '0') {
+            mantissa = mantissa * 10 + (*p - '0');
+            fast = fast && ++digits <= 15;
+        }
+    }
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++) {
+            found = true;
+            exponent--;
+            if (mantissa > 0 || *p != '0') {
+                mantissa = mantissa * 10 + (*p - '0');
+                fast = fast && ++digits <= 15;
+            }
+        }
+    }
+    if (found && (*p == 'e' || *p == 'E')) {
+        const char * q = p + 1;
+        bool negative_exponent = *q == '-';
+        if (*q == '-' || *q == '+') {
+            q++;
+        }
+        int e = 0;
+        if (*q < '0' || *q > '9') {
+            fast = false;
+        }
+        for (; *q >= '0' && *q <= '9'; q++) {
+            if (e < 10000) {
+                e = e * 10 + (*q - '0');
+            }
+        }
+        exponent += negative_exponent ? -e : e;
+        p = q;
+    }
+    if (found && fast && exponent >= -22 && exponent <= 22) {
+        x = exponent < 0
+            ? mantissa / powers[-exponent]
+            : mantissa * powers[exponent];
+        x = negative ? -x : x;
+        *end = p;
+        return true;
+    }
+    // strtod() skips any whitespace, including line breaks, so only call it
+    // on something that looks like a number.
+    if (!(isdigit(*s) || *s == '-' || *s == '+' || *s == '.'
+          || tolower(*s) == 'n' || tolower(*s) == 'i')) {
+        return false;
+    }
+    char * e;
+    x = strtod(s, &e);
+    *end = e;
+    return e != s;
+}
+
 // Compose multiple streams to print to more than one place at once.
 class ComposeStream : public std::ostream
 {
@@ -118,68 +295,192 @@ public:
     }
 };
 
-// This class is useful for reading tab-delimited tables of text.
-class Row
+// A string that points into memory owned by something else, like a line
+// from LineReader. It is only valid as long as that memory is.
+struct StringRef
 {
-public:
-    std::string const & operator[](std::size_t index) const
+    StringRef() : ptr(""), len(0) {}
+    StringRef(const char * p, size_t n) : ptr(p), len(n) {}
+    StringRef(const std::string & s) : ptr(s.data()), len(s.size()) {}
+
+    const char * data() const
     {
-        return m_data[index];
+        return ptr;
     }
-    std::size_t size() const
+    size_t size() const
+    {
+        return len;
+    }
+    bool empty() const
     {
-        return m_data.size();
+        return len == 0;
     }
-    void readNextRow(std::istream & str)
+    char operator[](size_t i) const
     {
-        std::string line, cell;
+        return ptr[i];
+    }
+    std::string str() const
+    {
+        return std::string(ptr, len);
+    }
+    bool operator==(const StringRef & s) const
+    {
+        return len == s.len && memcmp(ptr, s.ptr, len) == 0;
+    }
+    bool operator==(const char * s) const
+    {
+        return strlen(s) == len && memcmp(ptr, s, len) == 0;
+    }
 
-        std::getline(str, line);
+    const char * ptr;
+    size_t len;
+};
 
-        std::stringstream lineStream(line);
+// Parse the digits of a non-negative integer without the locale. Return
+// false unless the whole string is digits.
+inline bool parse_ulong(StringRef s, ulong & x)
+{
+    x = 0;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+        x = x * 10 + (s[i] - '0');
+    }
+    return s.size() > 0;
+}
 
-        m_data.clear();
+// Give each chromosome name a small integer id. Files are usually sorted
+// by chromosome, so we check the last name first.
+class ChromInterner
+{
+public:
+    ChromInterner() : _last(0) {}
 
-        while (std::getline(lineStream, cell, '\t')) {
-            // Remove spaces within each tab-delimited cell.
-            cell.erase(std::remove(cell.begin(), cell.end(), ' '),
-                       cell.end());
-            // Delete all occurrences of '^M' (aka '\r').
-            cell.erase(std::remove(cell.begin(), cell.end(), '\r'),
-                       cell.end());
-            m_data.push_back(cell);
+    uint32_t id(StringRef chrom)
+    {
+        if (_last < _names.size() && chrom == StringRef(_names[_last])) {
+            return _last;
         }
+        _key.assign(chrom.data(), chrom.size());
+        auto it = _ids.find(_key);
+        if (it != _ids.end()) {
+            return _last = it->second;
+        }
+        _last = _names.size();
+        _names.push_back(_key);
+        _ids[_key] = _last;
+        return _last;
     }
+
+    const std::string & name(uint32_t id) const
+    {
+        return _names[id];
+    }
+
+    size_t size() const
+    {
+        return _names.size();
+    }
+
+    void clear()
+    {
+        _names.clear();
+        _ids.clear();
+        _last = 0;
+    }
+
 private:
-    std::vector<std::string> m_data;
+    std::vector<std::string> _names;
+    std::unordered_map<std::string, uint32_t> _ids;
+    // Reused to look up names without allocating.
+    std::string _key;
+    uint32_t _last;
 };
 
-static std::istream & operator>>(std::istream & str, Row & data)
+// This class is useful for reading tab-delimited tables of text.
+class Row
 {
-    data.readNextRow(str);
-    return str;
-}
+public:
+    // Each cell is followed by a '\0', so an empty cell is "".
+    StringRef operator[](std::size_t index) const
+    {
+        return m_cells[index];
+    }
+    std::size_t size() const
+    {
+        return m_cells.size();
+    }
+    // Split a line into tab-delimited cells. A line ends at end, or at the
+    // first newline before it. The cells point into a buffer that is reused
+    // for the next line.
+    void parse(const char * begin, const char * end)
+    {
+        m_buffer.clear();
+        m_starts.clear();
+        const char * p = begin;
+        while (p < end && *p != '\n') {
+            m_starts.push_back(m_buffer.size());
+            for (; p < end && *p != '\t' && *p != '\n'; p++) {
+                // Remove spaces and '^M' (aka '\r') within each cell.
+                if (*p != ' ' && *p != '\r') {
+                    m_buffer.push_back(*p);
+                }
+            }
+            m_buffer.push_back('\0');
+            if (p < end && *p == '\t') {
+                p++;
+            }
+        }
+        // Point to the cells once the buffer has stopped moving.
+        m_cells.clear();
+        for (size_t i = 0; i < m_starts.size(); i++) {
+            size_t stop = i + 1 < m_starts.size()
+                ? m_starts[i + 1] : m_buffer.size();
+            m_cells.push_back(
+                StringRef(&m_buffer[m_starts[i]], stop - m_starts[i] - 1)
+            );
+        }
+    }
+private:
+    std::string m_buffer;
+    std::vector<size_t> m_starts;
+    std::vector<StringRef> m_cells;
+};
 
-// Simplified BED format that only uses the first 4 columns.
+// Simplified BED format that only uses the first 4 columns. The chromosome
+// and name point into the parsed line.
 class BEDRow
 {
 public:
-    std::string name;
-    genomic_interval i;
-    void readNextRow(std::istream & stream)
+    StringRef chrom, name;
+    ulong start, end;
+    // Read the whitespace-delimited chromosome, start, end and name from a
+    // line. The name is empty if there is no fourth column. Return false if
+    // the line does not start with an interval, like a comment or a "track"
+    // line.
+    bool parse(const char * begin, const char * line_end)
     {
-        stream >> i.chrom >> i.start >> i.end >> name;
-        // Skip until the end of the line.
-        stream.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        StringRef fields[4];
+        const char * p = begin;
+        for (int f = 0; f < 4; f++) {
+            while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+                p++;
+            }
+            const char * q = p;
+            while (q < line_end && !isspace(*q)) {
+                q++;
+            }
+            fields[f] = StringRef(p, q - p);
+            p = q;
+        }
+        chrom = fields[0];
+        name = fields[3];
+        return parse_ulong(fields[1], start) && parse_ulong(fields[2], end)
+               && chrom[0] != '#';
     }
 };
 
-static std::istream & operator>>(std::istream & stream, BEDRow & a)
-{
-    a.readNextRow(stream);
-    return stream;
-}
-
 static bool mkpath(const std::string & path)
 {
     bool bSuccess = false;
@@ -227,88 +528,6 @@ static void assert_file_exists(const std::string & path)
     }
 }
 
-// These two functions are inspired by:
-//      http://reference.mrpt.org/svn/eigen__plugins_8h_source.html#l00448
-
-// Remove columns of the matrix. The unsafe version assumes that the indices
-// are sorted in ascending order.
-static void unsafeRemoveColumns(
-    const std::vector<size_t> & idxs,
-    MatrixXd & m
-)
-{
-    size_t k = 1;
-    for (std::vector<size_t>::const_reverse_iterator it = idxs.rbegin();
-         it != idxs.rend(); it++, k++) {
-        const size_t nC = m.cols() - *it - k;
-        if (nC > 0) {
-            m.derived().block(0, *it, m.rows(), nC) =
-                m.derived().block(0, *it + 1, m.rows(), nC).eval();
-        }
-    }
-    m.derived().conservativeResize(NoChange, m.cols() - idxs.size());
-}
-
-// Remove columns of the matrix.
-static void removeColumns(
-    const std::vector<size_t> & idxsToRemove,
-    MatrixXd & m
-)
-{
-    std::vector<size_t> idxs = idxsToRemove;
-    std::sort(idxs.begin(), idxs.end());
-    std::vector<size_t>::iterator itEnd = std::unique(idxs.begin(), idxs.end());
-    idxs.resize(itEnd - idxs.begin());
-
-    unsafeRemoveColumns(idxs, m);
-}
-
-typedef std::pair<size_t, double> argsort_pair;
-
-static bool argsort_asc(const argsort_pair & left, const argsort_pair & right)
-{
-    // Ascending.
-    return left.second < right.second;
-}
-
-static bool argsort_desc(const argsort_pair & left, const argsort_pair & right)
-{
-    // Descending.
-    return left.second > right.second;
-}
-
-// Rank data in ascorting order with tie.method="mean" as in R.
-template<typename Derived>
-VectorXd rankdata(const MatrixBase<Derived> & x)
-{
-    VectorXd indices(x.size());
-    // Return an empty vector if we received one.
-    if (x.size() == 0) {
-        return indices;
-    }
-    // Create a vector of pairs (index, value).
-    std::vector<argsort_pair> data(x.size());
-    for (int i = 0; i < x.size(); i++) {
-        data[i].first = i;
-        data[i].second = x[i];
-    }
-    std::sort(data.begin(), data.end(), argsort_desc);
-
-    auto val = [&] (int i) { return data[i].second; };
-    auto ord = [&] (int i) { return data[i].first; };
-
-    for (int i = 0, reps; i < data.size(); i += reps) {
-        reps = 1;
-        while (i + reps < data.size() && val(i) == val(i + reps)) {
-            ++reps;
-        }
-        for (int j = 0; j < reps; j++) {
-            indices[ord(i + j)] = (2.0 * i + reps - 1.0) / 2.0 + 1.0;
-        }
-    }
-    return indices;
-}
-
 // Check if all values in a matrix are 1s and 0s.
 template<typename Derived>
 static bool is_binary(const MatrixBase<Derived> & x)
@@ -1,6 +1,8 @@
 // Copyright (c) 2013-2014 Kamil Slowikowski
 // See LICENSE for GPLv3 license.
 
+#include <unistd.h>
+
 #include "snpsea.h"
 
 // Include functions for controlling threads through OpenMP.
@@ -12,22 +14,105 @@
 #define omp_set_num_threads() 0
 #endif
 
+// Seed for the random draws of null genesets. Each null replicate's SNPs are
+// drawn with a generator also seeded with its index, and the null genesets
+// of count_nulls() with keys made from it.
+static const unsigned NULL_REPLICATE_SEED = 5489;
+
+// Thresholds for the proportions of null p-values in type1error.txt.
+static const std::vector<double> TYPE1_THRESHOLDS = {
+    0.5, 0.1, 0.05, 0.01, 0.005
+};
+
+// Genesets with more genes than this share one bin.
+static const ulong MAX_GENES = 10;
+
+// Bytes of null p-value counts to read at a time when writing
+// null_pvalues.txt.
+static const ulong NULL_PVALUES_BLOCK_BYTES = 1 << 26;
+
+// A random 64-bit number for each value of x, as in the SplitMix64
+// generator.
+static inline uint64_t mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Exact Monte Carlo p-value. See page 6.
+//
+//     Phipson, B. & Smyth, G. K. Permutation P-values should never be
+//     zero: calculating exact P-values when permutations are randomly
+//     drawn. Statistical Applications in Genetics and Molecular
+//     Biology 9, (2010).
+static double exact_pvalue(long nulls_observed, long nulls_tested)
+{
+    return (double(nulls_observed) + 1.0) / (double(nulls_tested) + 1.0);
+}
+
+// The name of a file without its folder or extensions, like "snps" for
+// "data/snps.bed.gz".
+static std::string file_stem(const std::string & filename)
+{
+    std::string name = filename.substr(filename.find_last_of('/') + 1);
+    return name.substr(0, name.find('.'));
+}
+
+// Write the items of a list separated by a delimiter.
+template <typename T>
+static std::string join(const std::vector<T> & items, char delim)
+{
+    std::ostringstream result;
+    for (size_t i = 0; i < items.size(); i++) {
+        if (i > 0) {
+            result << delim;
+        }
+        result << items[i];
+    }
+    return result.str();
+}
+
+// The name of an output file for one of the --score methods, like
+// "condition_pvalues.txt", or "condition_pvalues_total.txt" if there are
+// many methods.
+static std::string score_filename(
+    const std::string & prefix,
+    const std::vector<std::string> & score_methods,
+    ulong m
+)
+{
+    if (score_methods.size() == 1) {
+        return prefix + ".txt";
+    }
+    return prefix + "_" + score_methods[m] + ".txt";
+}
+
 // Main function that executes all of the intermediate steps.
 snpsea::snpsea(
     std::string user_snpset_file,
     std::string gene_matrix_file,
     std::string gene_intervals_file,
-    std::string snp_intervals_file,
+    std::vector<std::string> snp_intervals_files,
     std::string null_snps_file,
     std::string condition_file,
+    std::string condition_each,
+    std::string column_selection,
+    std::string locus_cache_folder,
+    std::string save_state_file,
+    std::string load_state_file,
     std::string out_folder,
-    std::string score_method,
-    ulong slop,
+    std::vector<std::string> score_methods,
+    std::vector<ulong> slops,
     int threads,
     ulong null_snpset_replicates,
+    bool write_null_pvalues,
     ulong min_observations,
-    ulong max_iterations
+    ulong max_iterations,
+    ulong max_memory
 )
+    : _gene_matrix(NULL, 0, 0)
 {
     // Log everything.
     _log.open(out_folder + "/log.txt",
@@ -37,119 +122,517 @@ snpsea::snpsea(
         user_snpset_file,
         gene_matrix_file,
         gene_intervals_file,
-        snp_intervals_file,
+        snp_intervals_files,
         null_snps_file,
         condition_file,
+        condition_each,
+        column_selection,
+        locus_cache_folder,
+        save_state_file,
+        load_state_file,
         out_folder,
-        score_method,
-        slop,
+        score_methods,
+        slops,
         threads,
         null_snpset_replicates,
+        write_null_pvalues,
         min_observations,
         max_iterations,
+        max_memory,
         _log
     );
 
-    // Read names of null SNPs that will be sampled to create random or
-    // matched SNP sets.
+    // Read the inputs and check for enrichment of each column in
+    // parallel. Ensure that a valid number of threads is used.
+    threads = clamp(threads, 1, cpu_count());
+    omp_set_num_threads(threads);
+    gzifstream::default_inflate_threads = threads;
+
     _log << timestamp() << " # Reading files ..." << std::endl;
-    read_names(null_snps_file, _null_snp_names);
 
-    // Optional condition file to condition on specified columns in the
-    // gene matrix.
-    if (condition_file.length() > 0) {
-        read_names(condition_file, _condition_names);
+    // We pick random SNPs later if --snps is like "random20".
+    bool random_user_snps = !file_exists(user_snpset_file);
+
+    // --snps may list the SNP files of many traits, which share everything
+    // we read and prepare below, and are each tested in a folder in --out.
+    std::vector<std::string> trait_files, trait_names;
+    if (random_user_snps
+        || !read_manifest(user_snpset_file, trait_files, trait_names)) {
+        trait_files.assign(1, user_snpset_file);
+        trait_names.assign(1, "");
     }
 
-    // Read SNP names and intervals.
-    read_bed_intervals(snp_intervals_file, _snp_intervals);
+    // Read the SNPs of every trait, so we find all of their intervals.
+    if (!random_user_snps) {
+        std::set<std::string> names;
+        for (const auto & file : trait_files) {
+            read_names(file, names);
+            _user_snp_names.insert(names.begin(), names.end());
+        }
+    }
 
-    // Read the gene matrix.
-    read_gct(gene_matrix_file, _row_names, _col_names, _gene_matrix);
+    // Each combination of --snp-intervals and --slop is tested in a folder
+    // in --out named after the ones that vary.
+    std::vector<std::string> interval_names;
+    std::set<std::string> seen_interval_names;
+    for (const auto & file : snp_intervals_files) {
+        interval_names.push_back(file_stem(file));
+        if (!seen_interval_names.insert(interval_names.back()).second) {
+            std::cerr << "ERROR: --snp-intervals lists two files named "
+                      << interval_names.back() + ", so their results would"
+                      << " share a folder" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    // Read the gene intervals but only keep the ones listed in the GCT.
-    read_bed_interval_tree(
-        gene_intervals_file,
-        _row_names,
-        _nrows,
-        _gene_interval_tree
+    // The columns of the gene matrix to test.
+    ColumnSelection columns(column_selection);
+
+    // The columns to condition on one at a time with --condition-each.
+    ColumnSelection each_columns(condition_each, "--condition-each");
+    bool conditioning_each = condition_each.length() > 0;
+
+    if (load_state_file.length() > 0) {
+        // Skip straight to the user's SNPs with the state saved by an
+        // earlier run. It has the slop that was used to find the genesets.
+        slops.assign(
+            1, load_state(load_state_file, snp_intervals_files[0], max_memory)
+        );
+        if (!columns.all()) {
+            std::vector<bool> keep = columns.select(_col_names);
+            if (_binary_gene_matrix) {
+                long n_kept = 0;
+                for (long i = 0; i < _binary_sums.size(); i++) {
+                    if (keep[i]) {
+                        _binary_sums[n_kept++] = _binary_sums[i];
+                    }
+                }
+                _binary_sums.conservativeResize(n_kept);
+                _binary_probs = _binary_sums / _nrows;
+            }
+            if (_gene_store.is_open()) {
+                select_columns(keep, _col_names, _gene_store, out_folder);
+            } else {
+                select_columns(keep, _col_names, _gene_matrix_data);
+            }
+            _log << timestamp() << " # Kept " << _col_names.size()
+                 << " columns chosen with --columns." << std::endl;
+        }
+        _log << timestamp() << " # done." << std::endl;
+    } else {
+        // Read names of null SNPs that will be sampled to create random or
+        // matched SNP sets.
+        read_names(null_snps_file, _null_snp_names);
+
+        // Optional condition file to condition on specified columns in the
+        // gene matrix.
+        if (condition_file.length() > 0) {
+            read_names(condition_file, _condition_names);
+        }
+
+        // Read the gene matrix, which may have been packed by snpsea-pack.
+        // Only read the columns chosen with --columns, unless we need all
+        // of them to condition on.
+        bool select_later = _condition_names.size() > 0 || conditioning_each;
+        ColumnSelection read_columns =
+            select_later ? ColumnSelection() : columns;
+        VectorXd row_norms;
+        bool ranked = false;
+
+        // Keep the matrix in a mapped file if it does not fit in
+        // --max-memory. We cannot condition on it there.
+        if (max_memory > 0) {
+            ulong rows, cols;
+            read_matrix_size(gene_matrix_file, read_columns, rows, cols);
+            if (sizeof(double) * rows * cols > max_memory) {
+                if (select_later) {
+                    std::cerr << "ERROR: --condition and --condition-each"
+                              << " cannot be used when the gene matrix does"
+                              << " not fit in --max-memory" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                _gene_store.create(out_folder, rows, cols);
+                _log << timestamp() << " # The gene matrix needs "
+                     << sizeof(double) * rows * cols / 1024.0 / 1024.0
+                     << " MB, so it is kept in a file in " + out_folder
+                     << "." << std::endl;
+            }
+        }
+
+        if (PackedMatrix::is_packed(gene_matrix_file)) {
+            ranked = read_packed_matrix(
+                gene_matrix_file, read_columns, _row_names, _col_names,
+                _gene_matrix_data, _gene_store, row_norms
+            );
+        } else {
+            // Buffer at most half of --max-memory while parsing.
+            read_gct(
+                gene_matrix_file, read_columns, _row_names, _col_names,
+                _gene_matrix_data, _gene_store, max_memory / 2, row_norms
+            );
+        }
+
+        // Read the gene intervals but only keep the ones listed in the GCT.
+        read_bed_interval_tree(
+            gene_intervals_file,
+            _row_names,
+            _nrows,
+            _gene_interval_tree
+        );
+
+        _log << timestamp() << " # done." << std::endl;
+
+        // Report names from the conditions file that are absent from the
+        // gene matrix file.
+        report_missing_conditions();
+
+        if (ranked && select_later) {
+            std::cerr << "ERROR: --condition and --condition-each need the"
+                      << " values of the gene matrix, so they cannot be used"
+                      << " with a matrix packed with --ranks" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        if (_gene_store.is_open()) {
+            prepare_gene_store(ranked, row_norms);
+        } else if (ranked) {
+            // The matrix was normalized and ranked by snpsea-pack --ranks.
+            _binary_gene_matrix = false;
+            _gene_matrix_data /= _nrows;
+        } else if (is_binary(_gene_matrix_data.col(0))) {
+            // Check if the matrix is binary by reading the first column.
+            // Let the user know we detected it.
+            _log << timestamp() << " # Expression is binary." << std::endl;
+            if (conditioning_each) {
+                std::cerr << "ERROR: --condition-each cannot be used with a"
+                          << " binary gene matrix" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            if (select_later) {
+                select_columns(
+                    columns.select(_col_names), _col_names, _gene_matrix_data
+                );
+            }
+            // Cache these values ahead of time.
+            _binary_sums = _gene_matrix_data.colwise().sum();
+            _binary_probs = _binary_sums / _nrows;
+            _binary_gene_matrix = true;
+        } else {
+            _binary_gene_matrix = false;
+
+            // Condition the matrix on the specified columns, then keep the
+            // columns chosen with --columns.
+            if (select_later) {
+                if (_condition_names.size() > 0) {
+                    condition(_gene_matrix_data, _condition_names);
+                }
+                // Keep the values of every column for --condition-each.
+                if (conditioning_each) {
+                    _each_values = _gene_matrix_data;
+                    _each_col_names = _col_names;
+                    _each_conditions = each_columns.select(_col_names);
+                }
+                row_norms = _gene_matrix_data.rowwise().norm();
+                select_columns(
+                    columns.select(_col_names), _col_names, _gene_matrix_data
+                );
+            }
+
+            // Normalize the matrix by the norms of the whole rows and
+            // reverse percentile rank each column.
+            // So, a small value like 0.02 means the given gene is highly
+            // specific to the column. A large value means the gene is
+            // non-specific.
+            rank_columns(_gene_matrix_data, row_norms);
+            _gene_matrix_data /= _nrows;
+        }
+    }
+
+    point_gene_matrix();
+
+    ulong n_combos = snp_intervals_files.size() * slops.size();
+    bool many_combos = n_combos > 1;
+    bool many_traits = trait_files.size() > 1;
+
+    std::ofstream args;
+    if (many_combos) {
+        args.open(out_folder + "/args.txt");
+        write_args(
+            user_snpset_file,
+            gene_matrix_file,
+            gene_intervals_file,
+            snp_intervals_files,
+            null_snps_file,
+            condition_file,
+            condition_each,
+            column_selection,
+            locus_cache_folder,
+            save_state_file,
+            load_state_file,
+            out_folder,
+            score_methods,
+            slops,
+            threads,
+            null_snpset_replicates,
+            write_null_pvalues,
+            min_observations,
+            max_iterations,
+            max_memory,
+            args
+        );
+        args.close();
+        _log << timestamp() << " # Testing " << n_combos
+             << " combinations of --snp-intervals and --slop with the same"
+             << " gene matrix." << std::endl;
+    }
+
+    // The SNPs to look up in each --snp-intervals file, before
+    // merge_user_snps() changes the user's SNPs.
+    std::unordered_set<std::string> snp_names(
+        _null_snp_names.begin(), _null_snp_names.end()
     );
+    snp_names.insert(_user_snp_names.begin(), _user_snp_names.end());
+
+    // The SNP files are outer, so each one is read once for all slops.
+    for (ulong k = 0; k < n_combos; k++) {
+        std::string snp_intervals_file = snp_intervals_files[k / slops.size()];
+        ulong slop = slops[k % slops.size()];
+
+        if (load_state_file.length() == 0 && k % slops.size() == 0) {
+            // Read SNP intervals, but only keep the ones we will look up.
+            _snp_intervals.clear();
+            read_bed_intervals(snp_intervals_file, snp_names, _snp_intervals);
+
+            // Report the null SNPs we could not find. The user's SNPs are
+            // reported one by one in overlap_genes().
+            ulong n_absent = 0;
+            for (const auto & snp : _null_snp_names) {
+                if (_snp_intervals.count(snp) == 0) {
+                    n_absent++;
+                }
+            }
+            if (n_absent > 0) {
+                _log << timestamp() << " # " << n_absent
+                     << " SNPs from the --null-snps file are absent from the"
+                     << " --snp-intervals file." << std::endl;
+            }
+        }
 
-    _log << timestamp() << " # done." << std::endl;
+        std::string combo_folder = out_folder;
 
-    // Report names from the conditions file that are absent from the
-    // gene matrix file.
-    report_missing_conditions();
+        // Each combination has its own folder, log and arguments, as if it
+        // were run alone with the same options.
+        if (many_combos) {
+            std::string name;
+            if (snp_intervals_files.size() > 1) {
+                name = interval_names[k / slops.size()];
+            }
+            if (slops.size() > 1) {
+                name += (name.empty() ? "slop" : "_slop")
+                        + std::to_string(slop);
+            }
+            combo_folder += "/" + name;
+            mkpath(combo_folder);
+
+            _log << timestamp() << " # Testing --snp-intervals \""
+                 << snp_intervals_file + "\" with --slop " << slop
+                 << " in " + combo_folder + " ..." << std::endl;
+            _log.close();
+            _log.open(combo_folder + "/log.txt",
+                      std::ofstream::out | std::ofstream::app);
+        }
 
-    // Drop all SNP intervals except those in the null set.
-    //drop_snp_intervals();
+        if (load_state_file.length() == 0) {
+            // Find a geneset for each SNP by querying the gene interval
+            // tree, or by reading the cached loci from a previous run.
+            find_snp_genesets(
+                snp_intervals_file,
+                gene_intervals_file,
+                locus_cache_folder,
+                slop
+            );
+        }
 
-    // Check if the matrix is binary by reading the first column.
-    if (is_binary(_gene_matrix.col(0))) {
-        // Let the user know we detected it.
-        _log << timestamp() << " # Expression is binary." << std::endl;
-        // Cache these values ahead of time.
-        _binary_sums = _gene_matrix.colwise().sum();
-        _binary_probs = _binary_sums / _nrows;
-        _binary_gene_matrix = true;
-    } else {
-        _binary_gene_matrix = false;
+        if (save_state_file.length() > 0) {
+            save_state(save_state_file, slop);
+        }
+
+        // Bin genesets by size. (This will be used to generate SNP sets.)
+        bin_genesets(MAX_GENES);
+
+        args.open(combo_folder + "/args.txt");
+        write_args(
+            user_snpset_file,
+            gene_matrix_file,
+            gene_intervals_file,
+            {snp_intervals_file},
+            null_snps_file,
+            condition_file,
+            condition_each,
+            column_selection,
+            locus_cache_folder,
+            save_state_file,
+            load_state_file,
+            combo_folder,
+            score_methods,
+            {slop},
+            threads,
+            null_snpset_replicates,
+            write_null_pvalues,
+            min_observations,
+            max_iterations,
+            max_memory,
+            args
+        );
+        args.close();
+
+        // merge_user_snps() changed the SNPs of the previous combination.
+        if (k > 0 && !many_traits && !random_user_snps) {
+            read_names(user_snpset_file, _user_snp_names);
+        }
+
+        // The genesets of each trait, and the number of them in each bin.
+        std::vector<std::vector<std::vector<ulong> > > trait_genesets(
+            trait_files.size()
+        );
+        std::vector<std::vector<ulong> > trait_bin_counts(trait_files.size());
+        std::vector<std::string> trait_folders;
+
+        if (many_traits) {
+            _log << timestamp() << " # Testing " << trait_files.size()
+                 << " traits listed in \"" + user_snpset_file + "\"."
+                 << std::endl;
+        }
+
+        for (ulong i = 0; i < trait_files.size(); i++) {
+            std::string trait_folder = combo_folder;
+
+            // Each trait has its own folder, log and arguments, as if it were
+            // run alone with the same options.
+            if (many_traits) {
+                trait_folder += "/" + trait_names[i];
+                mkpath(trait_folder);
+
+                _log << timestamp() << " # Testing \"" + trait_files[i]
+                     << "\" in " + trait_folder + " ..." << std::endl;
+
+                args.open(trait_folder + "/args.txt");
+                write_args(
+                    trait_files[i],
+                    gene_matrix_file,
+                    gene_intervals_file,
+                    {snp_intervals_file},
+                    null_snps_file,
+                    condition_file,
+                    condition_each,
+                    column_selection,
+                    locus_cache_folder,
+                    save_state_file,
+                    load_state_file,
+                    trait_folder,
+                    score_methods,
+                    {slop},
+                    threads,
+                    null_snpset_replicates,
+                    write_null_pvalues,
+                    min_observations,
+                    max_iterations,
+                    max_memory,
+                    args
+                );
+                args.close();
+
+                _log.close();
+                _log.open(trait_folder + "/log.txt",
+                          std::ofstream::out | std::ofstream::app);
+                read_names(trait_files[i], _user_snp_names);
+            }
 
-        // Condition the matrix on the specified columns.
-        condition(_gene_matrix, _condition_names);
+            test_trait(
+                trait_files[i],
+                trait_folder,
+                score_methods,
+                columns,
+                conditioning_each,
+                threads,
+                null_snpset_replicates,
+                write_null_pvalues,
+                min_observations,
+                max_iterations,
+                trait_genesets[i],
+                trait_bin_counts[i]
+            );
+            trait_folders.push_back(trait_folder);
+
+            if (many_traits) {
+                _log << timestamp() << " # The p-values of all traits are"
+                     << " computed together. See " + combo_folder + "/log.txt"
+                     << std::endl;
+                _log.close();
+                _log.open(combo_folder + "/log.txt",
+                          std::ofstream::out | std::ofstream::app);
+                _log << timestamp() << " # done." << std::endl;
+            }
+        }
+
+        _log << timestamp() << " # Computing one column at a time ..."
+             << std::endl;
+
+        // Calculate p-values for the SNPs of every trait with every score
+        // method together, so they share the work of drawing and scoring
+        // the null genesets.
+        calculate_pvalues(
+            trait_folders,
+            score_methods,
+            trait_genesets,
+            trait_bin_counts,
+            min_observations,
+            max_iterations
+        );
 
-        // Normalize the matrix.
-        _gene_matrix =
-            _gene_matrix.array().colwise() /
-            _gene_matrix.rowwise().norm().eval().array();
+        _log << timestamp() << " # done." << std::endl;
 
-        // Reverse percentile rank each column of the matrix.
-        // So, a small value like 0.02 means the given gene is highly specific
-        // to the column. A large value means the gene is non-specific.
-        for (int i = 0; i < _gene_matrix.cols(); i++) {
-            _gene_matrix.col(i) =
-                rankdata(_gene_matrix.col(i)) / _nrows;
+        if (many_combos) {
+            _log.close();
+            _log.open(out_folder + "/log.txt",
+                      std::ofstream::out | std::ofstream::app);
+            _log << timestamp() << " # done." << std::endl;
         }
     }
 
-    // 1. Find a geneset for each SNP by querying the gene interval tree.
-    // 2. Bin genesets by size. (This will be used to generate SNP sets.)
-    const ulong MAX_GENES = 10;
-    bin_genesets(slop, MAX_GENES);
+    _log.close();
+}
 
-    // Check for enrichment of each column in parallel.
-    // Ensure that a valid number of threads is used.
-    threads = clamp(threads, 1, cpu_count());
-    omp_set_num_threads(threads);
+// Test the user's SNPs in _user_snp_names for one trait, or random SNPs if
+// the name of the file is like "random20", and write the results to
+// out_folder. Return the trait's genesets, and the number of them in each
+// bin of _geneset_bins, so calculate_pvalues() can test many traits at once.
+void snpsea::test_trait(
+    std::string user_snpset_file,
+    std::string out_folder,
+    std::vector<std::string> score_methods,
+    const ColumnSelection & columns,
+    bool conditioning_each,
+    int threads,
+    ulong null_snpset_replicates,
+    bool write_null_pvalues,
+    ulong min_observations,
+    ulong max_iterations,
+    std::vector<std::vector<ulong> > & genesets,
+    std::vector<ulong> & bin_counts
+)
+{
+    // Start from the same seed for each trait, so its results are the same
+    // as when it is tested alone.
+    _random_generator.seed(std::mt19937::default_seed);
 
     int n_random_snps = 0;
 
-    if (file_exists(user_snpset_file)) {
-        read_names(user_snpset_file, _user_snp_names);
-    } else {
-        random_snps(user_snpset_file, _user_snp_names, slop);
+    if (!file_exists(user_snpset_file)) {
+        random_snps(user_snpset_file, _user_snp_names);
         n_random_snps = _user_snp_names.size();
     }
 
-    std::ofstream args(out_folder + "/args.txt");
-    write_args(
-        user_snpset_file,
-        gene_matrix_file,
-        gene_intervals_file,
-        snp_intervals_file,
-        null_snps_file,
-        condition_file,
-        out_folder,
-        score_method,
-        slop,
-        threads,
-        null_snpset_replicates,
-        min_observations,
-        max_iterations,
-        args
-    );
-    args.close();
-
     // Overlap the user's SNP intervals with the gene intervals. Record
     // the SNPs that are not present in the --snp-intervals file. Also
     // record the gene sets and their sizes.
@@ -157,8 +640,7 @@ snpsea::snpsea(
         _user_snp_names,
         _user_absent_snp_names,
         _user_genesets,
-        _user_geneset_sizes,
-        slop
+        _user_geneset_sizes
     );
 
     // Merge SNPs that share genes or have overlapping genes.
@@ -176,6 +658,7 @@ snpsea::snpsea(
             size = MAX_GENES;
         }
     }
+    bin_counts = count_bins(_user_geneset_sizes);
 
     _log << timestamp()
          << " # On each iteration, we will test "
@@ -216,37 +699,22 @@ snpsea::snpsea(
              << " null SNP sets ...\n"
              << std::flush;
 
-        for (ulong replicate = 0;
-             replicate < null_snpset_replicates; replicate++) {
-            // The user specified something like "random20" so let's
-            // generate a totally random list of SNPs without matching.
-            if (n_random_snps > 0) {
-                // Calculate p-values for random null gene sets.
-                calculate_pvalues(
-                    out_folder + "/null_pvalues.txt",
-                    score_method,
-                    random_genesets(n_random_snps, slop),
-                    min_observations,
-                    max_iterations,
-                    null_snpset_replicates
-                );
-            } else {
-                // Calculate p-values for matched null gene sets.
-                calculate_pvalues(
-                    out_folder + "/null_pvalues.txt",
-                    score_method,
-                    matched_genesets(),
-                    min_observations,
-                    max_iterations,
-                    null_snpset_replicates
-                );
-            }
-        }
+        // The user specified something like "random20", so null_pvalues()
+        // generates totally random lists of SNPs without matching.
+        null_pvalues(
+            out_folder,
+            write_null_pvalues,
+            score_methods,
+            n_random_snps,
+            null_snpset_replicates,
+            min_observations,
+            max_iterations
+        );
 
         _log << timestamp() << " # done." << std::endl;
     }
 
-    std::vector<std::vector<ulong> > genesets;
+    genesets.clear();
     for (auto item : _user_genesets) {
         genesets.push_back(item.second);
     }
@@ -254,64 +722,136 @@ snpsea::snpsea(
     // Report specificity scores and gene identifiers for each SNP-column pair.
     report_scores(out_folder + "/snp_condition_scores.txt", _user_genesets);
 
-    _log << timestamp() << " # Computing one column at a time ..."
-         << std::endl;
-
-    // Calculate p-values for the user's SNP set.
-    calculate_pvalues(
-        out_folder + "/condition_pvalues.txt",
-        score_method,
-        genesets,
-        min_observations,
-        max_iterations,
-        1L
-    );
-
-    _log << timestamp() << " # done." << std::endl;
-    _log.close();
+    // Calculate p-values conditioned on each chosen column in turn.
+    if (conditioning_each) {
+        condition_each_pvalues(
+            out_folder,
+            score_methods,
+            columns,
+            genesets,
+            min_observations,
+            max_iterations
+        );
+    }
 }
 
 void snpsea::write_args(
     std::string user_snpset_file,
     std::string gene_matrix_file,
     std::string gene_intervals_file,
-    std::string snp_intervals_file,
+    std::vector<std::string> snp_intervals_files,
     std::string null_snps_file,
     std::string condition_file,
+    std::string condition_each,
+    std::string column_selection,
+    std::string locus_cache_folder,
+    std::string save_state_file,
+    std::string load_state_file,
     std::string out_folder,
-    std::string score_method,
-    ulong slop,
+    std::vector<std::string> score_methods,
+    std::vector<ulong> slops,
     int threads,
     ulong null_snpset_replicates,
+    bool write_null_pvalues,
     ulong min_observations,
     ulong max_iterations,
+    ulong max_memory,
     std::ostream & stream
 )
 {
     stream << "# SNPsea " << SNPSEA_VERSION << "\n"
-           << "--snps             " << user_snpset_file << "\n"
-           << "--gene-matrix      " << gene_matrix_file << "\n"
-           << "--gene-intervals   " << gene_intervals_file << "\n"
-           << "--snp-intervals    " << snp_intervals_file << "\n"
-           << "--null-snps        " << null_snps_file << "\n";
+           << "--snps             " << user_snpset_file << "\n";
+    // These are replaced by --load-state.
+    if (load_state_file.length() == 0) {
+        stream << "--gene-matrix      " << gene_matrix_file << "\n"
+               << "--gene-intervals   " << gene_intervals_file << "\n";
+    }
+    stream << "--snp-intervals    " << join(snp_intervals_files, ',')
+           << "\n";
+    if (load_state_file.length() == 0) {
+        stream << "--null-snps        " << null_snps_file << "\n";
+    }
     if (condition_file.length() > 0) {
         stream << "--condition        " << condition_file << "\n";
     }
+    if (condition_each.length() > 0) {
+        stream << "--condition-each   " << condition_each << "\n";
+    }
+    if (column_selection.length() > 0) {
+        stream << "--columns          " << column_selection << "\n";
+    }
+    if (locus_cache_folder.length() > 0) {
+        stream << "--locus-cache      " << locus_cache_folder << "\n";
+    }
+    if (save_state_file.length() > 0) {
+        stream << "--save-state       " << save_state_file << "\n";
+    }
+    if (load_state_file.length() > 0) {
+        stream << "--load-state       " << load_state_file << "\n";
+    }
+    if (max_memory > 0) {
+        stream << "--max-memory       " << max_memory / 1024.0 / 1024.0
+               << "\n";
+    }
     stream << "--out              " << out_folder << "\n"
-           << "--score            " << score_method << "\n"
-           << "--slop             " << slop << "\n"
+           << "--score            " << join(score_methods, ',') << "\n"
+           << "--slop             " << join(slops, ',') << "\n"
            << "--threads          " << threads << "\n"
-           << "--null-snpsets     " << null_snpset_replicates << "\n"
-           << "--min-observations " << min_observations << "\n"
+           << "--null-snpsets     " << null_snpset_replicates << "\n";
+    if (!write_null_pvalues) {
+        stream << "--no-null-pvalues\n";
+    }
+    stream << "--min-observations " << min_observations << "\n"
            << "--max-iterations   " << max_iterations << "\n\n";
 }
 
+// Normalize and rank the columns of a gene matrix kept in a mapped file, or
+// detect that it is binary, one column at a time. We cannot condition on it.
+void snpsea::prepare_gene_store(bool ranked, const VectorXd & row_norms)
+{
+    Map<VectorXd> first(_gene_store.col(0), _gene_store.rows());
+    _binary_gene_matrix = !ranked && is_binary(first);
+    if (_binary_gene_matrix) {
+        _log << timestamp() << " # Expression is binary." << std::endl;
+        _binary_sums.resize(_gene_store.cols());
+    } else if (!ranked) {
+        rank_columns(_gene_store, row_norms);
+    }
+    for (ulong i = 0; i < _gene_store.cols(); i++) {
+        Map<VectorXd> col(_gene_store.col(i), _gene_store.rows());
+        if (_binary_gene_matrix) {
+            _binary_sums[i] = col.sum();
+        } else {
+            col /= _nrows;
+        }
+        _gene_store.release(i, 1);
+    }
+    if (_binary_gene_matrix) {
+        _binary_probs = _binary_sums / _nrows;
+    }
+}
+
+// Point _gene_matrix at the values we score, in memory or in a mapped file.
+void snpsea::point_gene_matrix()
+{
+    if (_gene_store.is_open()) {
+        new (&_gene_matrix) Map<const MatrixXd>(
+            _gene_store.data(), _gene_store.rows(), _gene_store.cols()
+        );
+    } else {
+        new (&_gene_matrix) Map<const MatrixXd>(
+            _gene_matrix_data.data(), _gene_matrix_data.rows(),
+            _gene_matrix_data.cols()
+        );
+    }
+}
+
 // Read an optionally gzipped text file and store the first column in a set of
 // strings.
 void snpsea::read_names(std::string filename, std::set<std::string> & names)
 {
-    gzifstream str(filename.c_str());
-    if (!str.is_open()) {
+    LineReader lines;
+    if (!lines.open(filename)) {
         std::cerr << "ERROR: Cannot open " + filename << std::endl;
         exit(EXIT_FAILURE);
     }
@@ -319,9 +859,9 @@ void snpsea::read_names(std::string filename, std::set<std::string> & names)
     Row row;
     bool found_snp = false;
     unsigned int snp_col = 0;
-    while (str >> row) {
-        // Skip lines that start with '#'.
-        if (row[0][0] == '#') {
+    while (lines.next(row)) {
+        // Skip empty lines and lines that start with '#'.
+        if (row.size() == 0 || row[0][0] == '#') {
             continue;
         }
         if (!found_snp) {
@@ -335,10 +875,10 @@ void snpsea::read_names(std::string filename, std::set<std::string> & names)
                 }
             }
             if (!found_snp) {
-                names.insert(row[snp_col]);
+                names.insert(row[snp_col].str());
             }
         } else {
-            names.insert(row[snp_col]);
+            names.insert(row[snp_col].str());
         }
     }
     if (names.size() == 0) {
@@ -349,44 +889,338 @@ void snpsea::read_names(std::string filename, std::set<std::string> & names)
          << names.size() << " items." << std::endl;
 }
 
-// Given the name of a SNP, look up its interval and find overlapping genes.
-// Report the offsets to lookup the genes in the gene matrix.
-std::vector<ulong> snpsea::snp_geneset(std::string snp, ulong slop)
+// Read a manifest of traits with the name of a SNP file on each line, and
+// optionally the name of the trait's folder in --out after it. By default,
+// the folder is named after the file, without its extensions. Return false
+// if the first line does not name an existing file, because then the file
+// lists SNPs instead. Exit if a later file is absent or a folder is reused.
+bool snpsea::read_manifest(
+    std::string filename,
+    std::vector<std::string> & files,
+    std::vector<std::string> & names
+)
 {
-    auto snp_interval = _snp_intervals[snp];
-    std::vector<ulong> indices;
+    LineReader lines;
+    if (!lines.open(filename)) {
+        std::cerr << "ERROR: Cannot open " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    files.clear();
+    names.clear();
+    std::set<std::string> seen;
+    Row row;
+    while (lines.next(row)) {
+        // Skip empty lines and lines that start with '#'.
+        if (row.size() == 0 || row[0][0] == '#') {
+            continue;
+        }
+        std::string file = row[0].str();
+        if (!file_exists(file)) {
+            if (files.empty()) {
+                return false;
+            }
+            std::cerr << "ERROR: " + filename + " lists a file that does"
+                      << " not exist: " + file << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::string name;
+        if (row.size() > 1) {
+            name = row[1].str();
+        } else {
+            name = file_stem(file);
+        }
+        if (name.empty() || !seen.insert(name).second) {
+            std::cerr << "ERROR: " + filename + " has an empty or repeated"
+                      << " folder name for " + file << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        files.push_back(file);
+        names.push_back(name);
+    }
+    if (files.empty()) {
+        return false;
+    }
+    _log << timestamp() << " # \"" + filename + "\" lists "
+         << files.size() << " traits." << std::endl;
+    return true;
+}
 
-    // Find overlapping genes.
+// Find the genes overlapping an interval in a tree. If there are none,
+// extend the interval by slop on both sides and try again.
+static std::vector<ulong> overlap_interval(
+    IntervalTree<ulong> & tree,
+    ulong start,
+    ulong end,
+    ulong slop
+)
+{
     std::vector<Interval<ulong> > gene_intervals;
-    _gene_interval_tree[snp_interval.chrom].findOverlapping(
-        snp_interval.start,
-        snp_interval.end,
-        gene_intervals
-    );
+    tree.findOverlapping(start, end, gene_intervals);
 
     if (gene_intervals.size() == 0) {
-        _gene_interval_tree[snp_interval.chrom].findOverlapping(
-            std::max(1UL, snp_interval.start - slop),
-            snp_interval.end + slop,
+        tree.findOverlapping(
+            std::max(1UL, start - slop),
+            end + slop,
             gene_intervals
         );
     }
 
-    if (gene_intervals.size() > 0) {
-        // Indices used for lookup in the gene matrix.
-        for (auto interval : gene_intervals) {
-            indices.push_back(interval.value);
+    std::vector<ulong> values;
+    for (auto interval : gene_intervals) {
+        values.push_back(interval.value);
+    }
+    return values;
+}
+
+// Given the name of a SNP, return the offsets to look up the genes that
+// overlap its interval in the gene matrix.
+std::vector<ulong> snpsea::snp_geneset(std::string snp)
+{
+    size_t i = _snp_intervals.find(snp);
+    if (i == SNPIntervalStore::npos) {
+        return std::vector<ulong>();
+    }
+    return std::vector<ulong>(
+        _snp_genes.begin() + _snp_gene_offsets[i],
+        _snp_genes.begin() + _snp_gene_offsets[i + 1]
+    );
+}
+
+// Fingerprint the contents of a BED file without reading all of it,
+// continuing from a previous hash. We hash its size and both ends, and the
+// index written by snpsea-index if it is at least as new as the file. The
+// index has an entry for every line, so it covers the middle of the file.
+static uint64_t hash_intervals_file(
+    std::string filename,
+    uint64_t h = 14695981039346656037ULL
+)
+{
+    h = hash_file_ends(filename, h);
+    std::string index_file = BEDIndex::filename(filename);
+    if (file_exists(index_file)) {
+        struct stat bed_stat, index_stat;
+        stat(filename.c_str(), &bed_stat);
+        stat(index_file.c_str(), &index_stat);
+        if (index_stat.st_mtime >= bed_stat.st_mtime) {
+            h = hash_file(index_file, h);
+        }
+    }
+    return h;
+}
+
+// Find the genes near each SNP in _snp_intervals and store them so
+// snp_geneset() can look them up.
+//
+// The genes near the null SNPs depend only on --snp-intervals,
+// --gene-intervals and --slop, so we cache them as gene identifiers in a
+// file named by a fingerprint of the contents of those files and the slop.
+// Runs with different gene matrices share the cache and translate the
+// identifiers to rows of their own matrix. For each SNP, the cache has the
+// genes overlapping its interval and the genes overlapping the interval
+// extended by slop, so we can pick the same genes as overlap_interval()
+// would with this matrix's tree.
+void snpsea::find_snp_genesets(
+    std::string snp_intervals_file,
+    std::string gene_intervals_file,
+    std::string cache_folder,
+    ulong slop
+)
+{
+    // The geneset for each SNP, or an empty list if it overlaps no genes.
+    std::vector<std::vector<ulong> > genesets(_snp_intervals.size());
+    std::vector<bool> found(_snp_intervals.size(), false);
+
+    std::string cache_file;
+    // Cached lines for null SNPs, to write back with any new ones.
+    std::map<std::string, std::string> cache_lines;
+
+    // Gene identifier => row in the gene matrix.
+    std::unordered_map<std::string, ulong> rows;
+    for (ulong i = 0; i < _row_names.size(); i++) {
+        rows[_row_names[i]] = i;
+    }
+    // Translate a comma-separated list of gene identifiers to rows,
+    // skipping genes that are absent from the gene matrix.
+    auto gene_rows = [&] (const std::string & genes) {
+        std::vector<ulong> result;
+        if (genes == "NA") {
+            return result;
+        }
+        for (const auto & gene : split_string(genes, ',')) {
+            auto it = rows.find(gene);
+            if (it != rows.end()) {
+                result.push_back(it->second);
+            }
+        }
+        return result;
+    };
+
+    if (cache_folder.length() > 0) {
+        // Key the cache on a fingerprint of the contents of the files, so
+        // we never read the whole --snp-intervals file just to name the
+        // cache.
+        uint64_t hash = hash_intervals_file(snp_intervals_file);
+        hash = hash_intervals_file(gene_intervals_file, hash);
+        hash = hash_bytes((const char *) &slop, sizeof(slop), hash);
+        std::ostringstream name;
+        name << cache_folder << "/loci-" << std::hex << std::setw(16)
+             << std::setfill('0') << hash << ".txt.gz";
+        cache_file = name.str();
+
+        if (file_exists(cache_file)) {
+            LineReader lines;
+            lines.open(cache_file);
+            Row row;
+            while (lines.next(row)) {
+                if (row.size() < 3 || row[0][0] == '#') {
+                    continue;
+                }
+                std::string snp = row[0].str();
+                size_t i = _snp_intervals.find(snp);
+                if (i != SNPIntervalStore::npos) {
+                    genesets[i] = gene_rows(row[1].str());
+                    if (genesets[i].size() == 0) {
+                        genesets[i] = gene_rows(row[2].str());
+                    }
+                    found[i] = true;
+                }
+                cache_lines[snp] =
+                    snp + '\t' + row[1].str() + '\t' + row[2].str();
+            }
+        }
+    }
+
+    // Compute the loci for null SNPs that are missing from the cache, with
+    // a tree of all genes in --gene-intervals, not only those in the gene
+    // matrix.
+    ulong n_missing = 0;
+    for (size_t i = 0; i < _snp_intervals.size(); i++) {
+        if (cache_file.length() > 0 && !found[i]
+            && _null_snp_names.count(_snp_intervals.name(i)) > 0) {
+            n_missing++;
+        }
+    }
+    if (n_missing > 0) {
+        _log << timestamp() << " # Caching the genes near " << n_missing
+             << " SNPs in \"" + cache_file + "\" ..." << std::endl;
+
+        std::vector<std::string> gene_names;
+        // Chromosome id => intervals.
+        ChromInterner chroms;
+        std::vector<std::vector<Interval<ulong> > > intervals;
+        LineReader lines;
+        lines.open(gene_intervals_file);
+        BEDRow row;
+        while (lines.next(row)) {
+            uint32_t chrom = chroms.id(row.chrom);
+            if (chrom >= intervals.size()) {
+                intervals.resize(chrom + 1);
+            }
+            intervals[chrom].push_back(
+                Interval<ulong>(row.start, row.end, gene_names.size())
+            );
+            gene_names.push_back(row.name.str());
+        }
+        std::unordered_map<std::string, IntervalTree<ulong> > tree;
+        for (uint32_t chrom = 0; chrom < intervals.size(); chrom++) {
+            tree[chroms.name(chrom)] = IntervalTree<ulong>(intervals[chrom]);
+        }
+
+        // Join the identifiers of the genes in these intervals with commas.
+        auto join = [&] (const std::vector<Interval<ulong> > & genes) {
+            if (genes.size() == 0) {
+                return std::string("NA");
+            }
+            std::string result = gene_names[genes[0].value];
+            for (size_t j = 1; j < genes.size(); j++) {
+                result += "," + gene_names[genes[j].value];
+            }
+            return result;
+        };
+
+        for (size_t i = 0; i < _snp_intervals.size(); i++) {
+            std::string snp = _snp_intervals.name(i);
+            if (found[i] || _null_snp_names.count(snp) == 0) {
+                continue;
+            }
+            auto & chrom_tree = tree[_snp_intervals.chrom(i)];
+            ulong start = _snp_intervals.start(i);
+            ulong end = _snp_intervals.end(i);
+            // Query without slop, then always with slop.
+            std::vector<Interval<ulong> > genes;
+            chrom_tree.findOverlapping(start, end, genes);
+            std::string exact = join(genes);
+            genes.clear();
+            chrom_tree.findOverlapping(
+                std::max(1UL, start - slop), end + slop, genes
+            );
+            std::string near = join(genes);
+
+            genesets[i] = gene_rows(exact);
+            if (genesets[i].size() == 0) {
+                genesets[i] = gene_rows(near);
+            }
+            found[i] = true;
+            cache_lines[snp] = snp + '\t' + exact + '\t' + near;
+        }
+
+        // Write to a temporary file and rename it, so other runs never read
+        // a partial cache.
+        std::string tmp_file =
+            cache_file + ".tmp" + std::to_string(getpid());
+        {
+            gzofstream cache(tmp_file.c_str());
+            cache << "# snp\tgenes\tgenes within " << slop << "\n";
+            for (const auto & item : cache_lines) {
+                cache << item.second << '\n';
+            }
+        }
+        if (rename(tmp_file.c_str(), cache_file.c_str()) != 0) {
+            std::cerr << "ERROR: Cannot write " + cache_file << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _log << timestamp() << " # done." << std::endl;
+    } else if (cache_file.length() > 0) {
+        _log << timestamp() << " # Read the genes near each null SNP from \""
+             << cache_file + "\"." << std::endl;
+    }
+
+    // The user's SNPs are not cached, so query this matrix's tree directly.
+    store_snp_genesets(genesets, found, slop);
+}
+
+// Find the genesets that were not found elsewhere by querying the gene
+// interval tree, then pack all of them so snp_geneset() can look them up.
+void snpsea::store_snp_genesets(
+    std::vector<std::vector<ulong> > & genesets,
+    const std::vector<bool> & found,
+    ulong slop
+)
+{
+    for (size_t i = 0; i < _snp_intervals.size(); i++) {
+        if (!found[i]) {
+            genesets[i] = overlap_interval(
+                _gene_interval_tree[_snp_intervals.chrom(i)],
+                _snp_intervals.start(i),
+                _snp_intervals.end(i),
+                slop
+            );
         }
     }
 
-    return indices;
+    // Pack the genesets into one array.
+    _snp_gene_offsets.assign(1, 0);
+    _snp_genes.clear();
+    for (const auto & geneset : genesets) {
+        _snp_genes.insert(_snp_genes.end(), geneset.begin(), geneset.end());
+        _snp_gene_offsets.push_back(_snp_genes.size());
+    }
 }
 
 // Generate a number of random SNPs given a filename like "random20".
 void snpsea::random_snps(
     std::string filename,
-    std::set<std::string> & names,
-    ulong slop
+    std::set<std::string> & names
 )
 {
     // Grab the desired length of the randomly generated SNP list.
@@ -394,60 +1228,139 @@ void snpsea::random_snps(
     // Skip the first 6 characters of "random20".
     int n = std::stoi(filename.substr(6), &sz);
 
-    // We can't access the elements of a set quickly, so just copy it. This
-    // uses extra memory, but I have about 600K SNPs in this list for TGP
-    // so it's not bad.
-    static std::vector<std::string> null_snps = make_vector(_null_snp_names);
-
-    // Standard Mersenne Twister random number generator.
-    static std::mt19937 generator;
-
     // Clear out the old set of SNP names.
     names.clear();
 
-    while (names.size() < n) {
-        // Pick a random null SNP name.
-        std::uniform_int_distribution<ulong>
-        distribution(0, null_snps.size() - 1);
+    for (auto i : sample_null_snps(n, _random_generator)) {
+        names.insert(_snp_intervals.name(i));
+    }
+}
 
-        auto r = distribution(generator);
+// Pick n distinct null SNPs that overlap at least one gene, and return their
+// indices in _snp_intervals in the order of _null_snp_ids.
+std::vector<size_t> snpsea::sample_null_snps(
+    ulong n,
+    std::mt19937 & generator
+)
+{
+    ulong n_snps = _null_snp_ids.size();
+    if (n > n_snps) {
+        std::cerr << "ERROR: Cannot pick " << n << " random SNPs, because"
+                  << " only " << n_snps << " SNPs in --null-snps overlap"
+                  << " genes." << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
-        // Sanity check. The SNP name must be in our map.
-        if (_snp_intervals.count(null_snps[r]) == 0) {
-            continue;
+    // Robert Floyd's algorithm draws n distinct positions with n draws.
+    std::set<ulong> picked;
+    for (ulong j = n_snps - n; j < n_snps; j++) {
+        std::uniform_int_distribution<ulong> distribution(0, j);
+        if (!picked.insert(distribution(generator)).second) {
+            picked.insert(j);
         }
+    }
 
-        // Grab the gene set for the given SNP.
-        auto geneset = snp_geneset(null_snps[r], slop);
+    std::vector<size_t> ids;
+    for (auto r : picked) {
+        ids.push_back(_null_snp_ids[r]);
+    }
+    return ids;
+}
 
-        // The SNP must overlap at least one gene.
-        if (geneset.size() == 0) {
-            continue;
+// Read an optionally gzipped BED file and store the genomic intervals in
+// a compact store of name => interval. Only keep the intervals for the
+// given names, so we never hold the whole file in memory.
+void snpsea::read_bed_intervals(
+    std::string filename,
+    const std::unordered_set<std::string> & names,
+    SNPIntervalStore & intervals
+)
+{
+    // Seek directly to the lines we need if the file has been indexed by
+    // snpsea-index.
+    std::string index_file = BEDIndex::filename(filename);
+    if (file_exists(index_file)) {
+        struct stat bed_stat, index_stat;
+        stat(filename.c_str(), &bed_stat);
+        stat(index_file.c_str(), &index_stat);
+        BEDIndex index;
+        if (index_stat.st_mtime < bed_stat.st_mtime) {
+            _log << timestamp() << " # \"" + index_file + "\" is older than"
+                 << " the BED file, so we will not use it." << std::endl;
+        } else if (!is_bgzf(filename) || !index.open(index_file)) {
+            _log << timestamp() << " # \"" + index_file + "\" is not a"
+                 << " valid index, so we will not use it." << std::endl;
+        } else {
+            read_bed_intervals_indexed(filename, index, names, intervals);
+            return;
         }
+    }
 
-        // Put a new SNP name in.
-        names.insert(null_snps[r]);
+    LineReader lines;
+    if (!lines.open(filename)) {
+        std::cerr << "ERROR: Cannot open " + filename << std::endl;
+        exit(EXIT_FAILURE);
     }
+    ulong n_intervals = 0;
+    BEDRow row;
+    // Reused to look up names without allocating.
+    std::string name;
+    while (lines.next(row)) {
+        n_intervals++;
+        name.assign(row.name.data(), row.name.size());
+        if (names.count(name) != 0) {
+            intervals.insert(name, row.chrom, row.start, row.end);
+        }
+    }
+    intervals.finalize();
+    _log << timestamp() << " # \"" + filename + "\" has "
+         << n_intervals << " intervals. Kept "
+         << intervals.size() << " of them." << std::endl;
 }
 
-// Read an optionally gzipped BED file and store the genomic intervals in
-// a map of name => interval.
-void snpsea::read_bed_intervals(
+// Read the lines for the given names from a BGZF-compressed BED file, using
+// an index created by snpsea-index.
+void snpsea::read_bed_intervals_indexed(
     std::string filename,
-    std::unordered_map<std::string, genomic_interval> & intervals
+    const BEDIndex & index,
+    const std::unordered_set<std::string> & names,
+    SNPIntervalStore & intervals
 )
 {
-    gzifstream stream(filename.c_str());
-    if (!stream.is_open()) {
+    BGZFReader reader;
+    if (!reader.open(filename)) {
         std::cerr << "ERROR: Cannot open " + filename << std::endl;
         exit(EXIT_FAILURE);
     }
+
+    // Read the lines in file order, so each block is inflated only once.
+    std::vector<uint64_t> voffsets;
+    for (const auto & name : names) {
+        index.find(name, voffsets);
+    }
+    std::sort(voffsets.begin(), voffsets.end());
+    voffsets.erase(
+        std::unique(voffsets.begin(), voffsets.end()), voffsets.end()
+    );
+
+    std::string line;
     BEDRow row;
-    while (stream >> row) {
-        intervals[row.name] = row.i;
+    for (auto voffset : voffsets) {
+        if (!reader.seek(voffset) || !reader.getline(line)) {
+            std::cerr << "ERROR: \"" + BEDIndex::filename(filename) + "\""
+                      << " does not match " + filename << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // Different names may have the same hash.
+        if (row.parse(line.data(), line.data() + line.size())
+            && names.count(row.name.str()) != 0) {
+            intervals.insert(row.name, row.chrom, row.start, row.end);
+        }
     }
+    intervals.finalize();
     _log << timestamp() << " # \"" + filename + "\" has "
-         << intervals.size() << " intervals." << std::endl;
+         << index.size() << " intervals. Kept "
+         << intervals.size() << " of them." << std::endl;
 }
 
 // Read an optionally gzipped BED file and store the genomic intervals in
@@ -459,8 +1372,8 @@ void snpsea::read_bed_interval_tree(
     std::unordered_map<std::string, IntervalTree<ulong> > & tree
 )
 {
-    gzifstream stream(filename.c_str());
-    if (!stream.is_open()) {
+    LineReader lines;
+    if (!lines.open(filename)) {
         std::cerr << "ERROR: Cannot open " + filename << std::endl;
         exit(EXIT_FAILURE);
     }
@@ -470,7 +1383,8 @@ void snpsea::read_bed_interval_tree(
 
     // Map a chromosome name to a vector of intervals.
     typedef Interval<ulong> interval;
-    std::unordered_map<std::string, vector<interval> > intervals;
+    ChromInterner chroms;
+    std::vector<vector<interval> > intervals;
 
     // Rather than storing the gene identifiers in the tree, we'll store the
     // indices of the gene identifiers in the provided vector.
@@ -484,17 +1398,23 @@ void snpsea::read_bed_interval_tree(
 
     ulong skipped_genes = 0;
     BEDRow row;
-    while (stream >> row) {
+    std::string name;
+    while (lines.next(row)) {
+        name.assign(row.name.data(), row.name.size());
         // Skip the gene if it is not present in the gene matrix.
-        if (row_names_set.count(row.name) != 0) {
+        if (row_names_set.count(name) != 0) {
             // Add an interval to the vector for the corresponding chromosome.
             // (The value stored in the tree is a ulong that is an index to
             // the row names of the gene matrix. It is later retrieved with
             // the findOverlapping() method.)
-            intervals[row.i.chrom].push_back(
-                interval(row.i.start, row.i.end, index[row.name])
+            uint32_t chrom = chroms.id(row.chrom);
+            if (chrom >= intervals.size()) {
+                intervals.resize(chrom + 1);
+            }
+            intervals[chrom].push_back(
+                interval(row.start, row.end, index[name])
             );
-            bed_genes.insert(row.name);
+            bed_genes.insert(name);
         } else {
             skipped_genes++;
         }
@@ -521,91 +1441,113 @@ void snpsea::read_bed_interval_tree(
          << " --gene-intervals file."
          << std::endl;
 
-    // Loop through the chromosomes.
-    for (auto item : intervals) {
-        // item.first is the name of a chromosome.
-        tree[item.first] = IntervalTree<ulong> (intervals[item.first]);
+    // Loop through the chromosomes. Keep the intervals in case we save
+    // them with --save-state.
+    for (uint32_t chrom = 0; chrom < intervals.size(); chrom++) {
+        tree[chroms.name(chrom)] = IntervalTree<ulong> (intervals[chrom]);
+        _gene_intervals[chroms.name(chrom)] = intervals[chrom];
     }
 }
 
 void snpsea::read_gct(
     std::string filename,
+    const ColumnSelection & columns,
     std::vector<std::string> & row_names,
     std::vector<std::string> & col_names,
-    MatrixXd & data
+    MatrixXd & data,
+    MappedMatrix & store,
+    ulong max_bytes,
+    VectorXd & row_norms
 )
 {
-    gzifstream stream(filename.c_str());
-    if (!stream.is_open()) {
-        std::cerr << "ERROR: Cannot open " + filename << std::endl;
-        exit(EXIT_FAILURE);
+    ulong rows, cols;
+    if (store.is_open()) {
+        ::read_gct(
+            filename, columns, max_bytes, row_names, col_names, store,
+            row_norms
+        );
+        rows = store.rows();
+        cols = store.cols();
+    } else {
+        ::read_gct(filename, columns, row_names, col_names, data, row_norms);
+        rows = data.rows();
+        cols = data.cols();
     }
-
-    // Check that the first line is correct.
-    std::string str;
-    stream >> str;
-    if (str.find("#1.2") != 0) {
-        std::cerr << "ERROR: Not a GCT file " + filename << std::endl;
-        exit(EXIT_FAILURE);
+    _log << timestamp()
+         << " # \"" + filename + "\" has "
+         << rows << " rows, " << cols << " columns";
+    if (!columns.all()) {
+        _log << " chosen with --columns";
     }
+    _log << "." << std::endl;
+}
 
-    // Read the number of rows and columns.
-    unsigned int rows, cols;
-    stream >> rows >> cols;
-    // Skip to next line.
-    std::getline(stream, str);
-
-    if (rows <= 0 || cols <= 0) {
-        std::cerr << "ERROR: Line 2 of GCT file is malformed " + filename
+// Read a gene matrix written by snpsea-pack. Return true if it holds ranks
+// rather than raw values, which need no row norms.
+bool snpsea::read_packed_matrix(
+    std::string filename,
+    const ColumnSelection & columns,
+    std::vector<std::string> & row_names,
+    std::vector<std::string> & col_names,
+    MatrixXd & data,
+    MappedMatrix & store,
+    VectorXd & row_norms
+)
+{
+    PackedMatrix matrix;
+    if (!matrix.open(filename)) {
+        std::cerr << "ERROR: Not a valid packed matrix " + filename
                   << std::endl;
         exit(EXIT_FAILURE);
-    } else {
-        _log << timestamp()
-             << " # \"" + filename + "\" has "
-             << rows << " rows, " << cols << " columns." << std::endl;
     }
-
-    // Resize our matrix to hold all of the data.
-    data.resize(rows, cols);
-
-    // Skip "Name" and "Description".
-    std::getline(stream, str, '\t');
-    std::getline(stream, str, '\t');
-    // Read the column names.
-    for (int c = 0; c < cols - 1; c++) {
-        std::getline(stream, str, '\t');
-        str.erase(std::remove(str.begin(), str.end(), '\n'), str.end());
-        col_names.push_back(str);
+    row_names = matrix.row_names();
+    col_names = matrix.col_names();
+    Map<const MatrixXd> values(matrix.data(), matrix.rows(), matrix.cols());
+    bool ranked = matrix.kind() == PackedMatrix::RANKS;
+    if (!ranked) {
+        row_norms = values.rowwise().norm();
     }
-    stream >> str;
-    col_names.push_back(str);
-    // Skip to next line.
-    std::getline(stream, str);
-
-    for (int r = 0; r < rows; r++) {
-        // Read the Name in the first column.
-        std::getline(stream, str, '\t');
-        row_names.push_back(str);
 
-        // Skip the Description column.
-        std::getline(stream, str, '\t');
-
-        // Read the data in this row.
-        for (int c = 0; c < cols; c++) {
-            stream >> data(r, c);
+    // Copy the kept columns. The values are column-major, so the pages of
+    // the other columns are never read unless we need the row norms.
+    std::vector<bool> keep = columns.select(col_names);
+    if (!store.is_open()) {
+        data.resize(
+            values.rows(), std::count(keep.begin(), keep.end(), true)
+        );
+    }
+    long n_kept = 0;
+    for (long i = 0; i < values.cols(); i++) {
+        if (keep[i]) {
+            if (store.is_open()) {
+                Map<VectorXd>(store.col(n_kept), store.rows()) =
+                    values.col(i);
+                store.release(n_kept, 1);
+            } else {
+                data.col(n_kept) = values.col(i);
+            }
+            col_names[n_kept] = col_names[i];
+            n_kept++;
         }
+    }
+    col_names.resize(n_kept);
 
-        // Skip to next line.
-        std::getline(stream, str);
+    _log << timestamp()
+         << " # \"" + filename + "\" has "
+         << values.rows() << " rows, " << n_kept << " columns of "
+         << (ranked ? "ranks" : "values");
+    if (!columns.all()) {
+        _log << " chosen with --columns";
     }
+    _log << "." << std::endl;
+    return ranked;
 }
 
 void snpsea::overlap_genes(
     std::set<std::string> & snp_names,
     std::set<std::string> & absent_snp_names,
     std::unordered_map<std::string, std::vector<ulong> > & genesets,
-    std::vector<ulong> & geneset_sizes,
-    ulong slop
+    std::vector<ulong> & geneset_sizes
 )
 {
     _log << timestamp()
@@ -613,6 +1555,7 @@ void snpsea::overlap_genes(
 
     // Clear out the old gene sets from previous runs.
     absent_snp_names.clear();
+    _user_naked_snp_names.clear();
     geneset_sizes.clear();
     genesets.clear();
 
@@ -623,7 +1566,7 @@ void snpsea::overlap_genes(
             absent_snp_names.insert(snp);
         } else {
             // Find the SNP's interval and find overlapping genes.
-            std::vector<ulong> gene_ids = snp_geneset(snp, slop);
+            std::vector<ulong> gene_ids = snp_geneset(snp);
             if (gene_ids.size() > 0) {
                 genesets[snp] = gene_ids;
             } else {
@@ -647,54 +1590,75 @@ void snpsea::merge_user_snps(
     std::unordered_map<std::string, std::vector<ulong> > new_genesets;
     std::vector<ulong> new_geneset_sizes;
 
-    std::set<std::string> merged_snps;
+    // The SNPs with genesets, in sorted order.
+    std::vector<std::string> names;
+    for (const auto & snp : snp_names) {
+        if (genesets.count(snp) > 0) {
+            names.push_back(snp);
+        }
+    }
+
+    // Union-find over the SNPs. The root of each locus is its first SNP.
+    std::vector<ulong> parent(names.size());
+    for (ulong i = 0; i < names.size(); i++) {
+        parent[i] = i;
+    }
+    auto find = [&] (ulong i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+
+    // If two SNPs share a gene, then merge them. Each gene remembers the
+    // first SNP we saw with it.
+    std::unordered_map<ulong, ulong> gene_snps;
+    for (ulong i = 0; i < names.size(); i++) {
+        for (auto gene : genesets[names[i]]) {
+            auto it = gene_snps.insert(std::make_pair(gene, i)).first;
+            ulong a = find(i), b = find(it->second);
+            if (a != b) {
+                parent[std::max(a, b)] = std::min(a, b);
+            }
+        }
+    }
+
+    // Collect the SNPs of each locus, in sorted order.
+    std::vector<std::vector<ulong> > loci(names.size());
+    for (ulong i = 0; i < names.size(); i++) {
+        loci[find(i)].push_back(i);
+    }
 
     int count_merged = 0;
+    ulong count_merged_snps = 0;
 
-    // Brute force, check all pairs of SNPs.
-    // If two SNPs reside on the same chromosome and have shared or
-    // overlapping genes, then merge them.
-    for (auto a : snp_names) {
-        if (genesets.count(a) == 0) continue;
-        if (merged_snps.count(a) > 0) continue;
-
-        std::vector<ulong> genes_a = genesets[a];
-        std::sort(genes_a.begin(), genes_a.end());
-
-        std::string merged_snp = a;
-
-        for (auto b : snp_names) {
-            if (a.compare(b) == 0) continue;
-            if (genesets.count(b) == 0) continue;
-            if (merged_snps.count(b) > 0) continue;
-
-            std::vector<ulong> genes_b = genesets[b];
-            std::sort(genes_b.begin(), genes_b.end());
-
-            // Find the union of the two gene sets.
-            std::vector<ulong> genes_ab(genes_a.size() + genes_b.size());
-            std::vector<ulong>::iterator it;
-            it = std::set_union(genes_a.begin(), genes_a.end(),
-                                genes_b.begin(), genes_b.end(),
-                                genes_ab.begin());
-            genes_ab.resize(it - genes_ab.begin());
-
-            if (genes_ab.size() < genes_a.size() + genes_b.size()) {
-                merged_snp += "," + b;
-                genes_a = genes_ab;
-                merged_snps.insert(a);
-                merged_snps.insert(b);
-            }
+    for (ulong i = 0; i < names.size(); i++) {
+        if (loci[i].empty()) {
+            continue;
+        }
+        // Name the locus by its SNPs, like "rs1,rs2", and take the union
+        // of their genes.
+        std::string merged_snp = names[i];
+        std::vector<ulong> genes = genesets[names[i]];
+        for (ulong j = 1; j < loci[i].size(); j++) {
+            const std::string & snp = names[loci[i][j]];
+            merged_snp += "," + snp;
+            genes.insert(genes.end(), genesets[snp].begin(),
+                         genesets[snp].end());
         }
+        std::sort(genes.begin(), genes.end());
+        genes.erase(std::unique(genes.begin(), genes.end()), genes.end());
 
         // Did we merge a SNP with other SNPs?
-        if (merged_snp.find(",") != std::string::npos) {
+        if (loci[i].size() > 1) {
             count_merged++;
+            count_merged_snps += loci[i].size();
         }
 
         new_snp_names.insert(merged_snp);
-        new_genesets[merged_snp] = genes_a;
-        new_geneset_sizes.push_back(genes_a.size());
+        new_geneset_sizes.push_back(genes.size());
+        new_genesets[merged_snp].swap(genes);
     }
 
     snp_names = new_snp_names;
@@ -702,7 +1666,7 @@ void snpsea::merge_user_snps(
     geneset_sizes = new_geneset_sizes;
 
     _log << timestamp() << " # Merged "
-         << merged_snps.size() << " SNPs into "
+         << count_merged_snps << " SNPs into "
          << count_merged << " loci.\n" << std::flush;
 }
 
@@ -722,7 +1686,7 @@ void snpsea::report_user_snp_genes(const std::string & filename)
 
     // Print a row for each of the user's SNPs that hits 0 genes.
     for (auto snp : _user_naked_snp_names) {
-        auto snp_interval = _snp_intervals[snp];
+        auto snp_interval = _snp_intervals.get(snp);
         std::string chrom = snp_interval.chrom;
         ulong start = snp_interval.start;
         ulong end = snp_interval.end;
@@ -743,7 +1707,7 @@ void snpsea::report_user_snp_genes(const std::string & filename)
         if (snp.find(",") != std::string::npos) {
             // Loop through the snps and choose the min start, max end.
             for (auto merged_snp : split_string(snp, ',')) {
-                auto snp_interval = _snp_intervals[merged_snp];
+                auto snp_interval = _snp_intervals.get(merged_snp);
                 chrom = snp_interval.chrom;
                 if (start == 0 || snp_interval.start < start) {
                     start = snp_interval.start;
@@ -753,7 +1717,7 @@ void snpsea::report_user_snp_genes(const std::string & filename)
                 }
             }
         } else {
-            auto snp_interval = _snp_intervals[snp];
+            auto snp_interval = _snp_intervals.get(snp);
             chrom = snp_interval.chrom;
             start = snp_interval.start;
             end = snp_interval.end;
@@ -784,29 +1748,6 @@ void snpsea::report_user_snp_genes(const std::string & filename)
     _log << timestamp() << " # done." << std::endl;
 }
 
-/*
-// Drop intervals for SNPs absent from "--null-snps". This is desirable to
-// reduce memory usage, but must be done after the user's SNPs are assigned
-// intervals.
-void snpsea::drop_snp_intervals()
-{
-    ulong dropped_snps = 0;
-    auto it = _snp_intervals.begin();
-    while (it != _snp_intervals.end()) {
-        if (_null_snp_names.count(it->first) == 0) {
-            _snp_intervals.erase(it++);
-            dropped_snps++;
-        } else {
-            ++it;
-        }
-    }
-    _log << timestamp()
-         << " # Dropped " << dropped_snps
-         << " SNP intervals that are absent from the provided null set."
-         << std::endl;
-}
-*/
-
 void snpsea::report_missing_conditions()
 {
     if (_condition_names.size() == 0) {
@@ -832,52 +1773,209 @@ void snpsea::report_missing_conditions()
 }
 
 // Condition the gene matrix on the specified column names. Each column is
-// projected onto a condition column, and its projection is substracted.
+// replaced by its residual after projecting it onto the span of all of the
+// condition columns, and then the condition columns are removed.
 void snpsea::condition(
     MatrixXd & matrix,
     std::set<std::string> & col_names
 )
 {
-    std::vector<std::string>
-    new_col_names(_col_names.begin(), _col_names.end());
+    std::vector<bool> keep(_col_names.size(), true);
+    std::vector<long> idxs;
+    for (size_t col = 0; col < _col_names.size(); col++) {
+        if (col_names.count(_col_names[col]) > 0) {
+            keep[col] = false;
+            idxs.push_back(col);
+        }
+    }
 
-    std::vector<size_t> idxs;
+    // An orthonormal basis Q for the condition columns. Column pivoting
+    // puts the independent columns first, so we drop any that are linear
+    // combinations of the others.
+    MatrixXd conditions(matrix.rows(), idxs.size());
+    for (size_t i = 0; i < idxs.size(); i++) {
+        conditions.col(i) = matrix.col(idxs[i]);
+    }
+    ColPivHouseholderQR<MatrixXd> qr(conditions);
+    MatrixXd q = qr.householderQ()
+                 * MatrixXd::Identity(matrix.rows(), qr.rank());
+
+    // Subtract the projection M - Q(Q'M) in blocks of columns, in parallel.
+    const long BLOCK = 64;
+    #pragma omp parallel for schedule(dynamic)
+    for (long first = 0; first < matrix.cols(); first += BLOCK) {
+        long n = std::min(BLOCK, matrix.cols() - first);
+        MatrixXd coefs = q.transpose() * matrix.middleCols(first, n);
+        matrix.middleCols(first, n).noalias() -= q * coefs;
+    }
 
-    for (const auto & col_name : col_names) {
-        auto it = std::find(_col_names.begin(), _col_names.end(), col_name);
-        size_t col_index = it - _col_names.begin();
+    // Remove the condition columns and their names in one pass.
+    select_columns(keep, _col_names, matrix);
+}
 
-        idxs.push_back(col_index);
+// For each column chosen with --condition-each, condition the matrix on that
+// column alone, rank the columns chosen with --columns again, and test them.
+// This is a full ranking of those columns for each condition, since the
+// norms of the rows change.
+// Write one row of p-values for each condition, with NA for the condition
+// itself, to condition_each_pvalues.txt in out_folder, or to a file for each
+// score method if there are many.
+void snpsea::condition_each_pvalues(
+    std::string out_folder,
+    const std::vector<std::string> & score_methods,
+    const ColumnSelection & columns,
+    const std::vector<std::vector<ulong> > & genesets,
+    long min_observations,
+    long max_iterations
+)
+{
+    std::vector<bool> keep = columns.select(_each_col_names);
+    std::vector<score_function> score = get_score_functions(score_methods);
+    ulong nmethods = score.size();
+    long n_conditions = std::count(
+        _each_conditions.begin(), _each_conditions.end(), true
+    );
 
-        const auto b = VectorXd(matrix.col(col_index));
+    _log << timestamp() << " # Conditioning on each of " << n_conditions
+         << " columns ..." << std::endl;
+
+    std::vector<std::ofstream> streams(nmethods);
+    for (ulong m = 0; m < nmethods; m++) {
+        streams[m].open(score_filename(
+            out_folder + "/condition_each_pvalues", score_methods, m
+        ));
+        streams[m] << "condition";
+        for (const auto & name : _col_names) {
+            streams[m] << "\t" << name;
+        }
+        streams[m] << "\n";
+    }
 
-        for (size_t col = 0; col < _col_names.size(); col++) {
-            auto a = matrix.col(col);
-            auto projection = a.dot(b) / b.dot(b) * b;
+    // The user's genesets are tested like the scores of one trait for each
+    // method, with a different stream of null genesets for each condition.
+    std::vector<ulong> methods(nmethods);
+    std::iota(methods.begin(), methods.end(), 0);
+    std::vector<std::vector<double> > scores(nmethods);
+    std::vector<std::vector<ulong> > counts(
+        nmethods, count_bins(_user_geneset_sizes)
+    );
+    std::vector<std::vector<long> > observed(nmethods), tested(nmethods);
+
+    // The residuals of the tested columns, in one buffer for every
+    // condition.
+    std::vector<std::string> col_names;
+    for (size_t j = 0; j < _each_col_names.size(); j++) {
+        if (keep[j]) {
+            col_names.push_back(_each_col_names[j]);
+        }
+    }
+    long rows = _each_values.rows();
+    long cols = _each_values.cols();
+    MatrixXd residuals(rows, col_names.size());
+    VectorXd row_norms(rows);
+    const long BLOCK = 4096;
+
+    long done = 0;
+    for (size_t c = 0; c < _each_col_names.size(); c++) {
+        if (!_each_conditions[c]) {
+            continue;
+        }
+        // Subtract the projection of every column onto column c, which
+        // leaves column c with nothing. The norms of the rows need every
+        // column, but we only keep the residuals of the tested ones. Every
+        // tested column is ranked again, since the norms change.
+        const VectorXd b = _each_values.col(c);
+        RowVectorXd coefs = RowVectorXd::Zero(cols);
+        double norm = b.squaredNorm();
+        if (norm > 0) {
+            coefs = b.transpose() * _each_values / norm;
+        }
+        #pragma omp parallel for schedule(dynamic)
+        for (long first = 0; first < rows; first += BLOCK) {
+            long n = std::min(BLOCK, rows - first);
+            ArrayXd sums = ArrayXd::Zero(n);
+            ArrayXd r(n);
+            for (long j = 0, k = 0; j < cols; j++) {
+                if (j == (long) c) {
+                    r.setZero();
+                } else {
+                    r = _each_values.col(j).segment(first, n).array()
+                        - coefs(j) * b.segment(first, n).array();
+                    sums += r.square();
+                }
+                if (keep[j]) {
+                    residuals.col(k++).segment(first, n) = r.matrix();
+                }
+            }
+            row_norms.segment(first, n) = sums.sqrt().matrix();
+        }
+        rank_columns(residuals, row_norms);
+        residuals /= _nrows;
+        new (&_gene_matrix) Map<const MatrixXd>(
+            residuals.data(), residuals.rows(), residuals.cols()
+        );
 
-            matrix.col(col) -= projection;
+        for (auto & stream : streams) {
+            stream << _each_col_names[c];
+        }
+        for (ulong col = 0; col < col_names.size(); col++) {
+            if (col_names[col] == _each_col_names[c]) {
+                for (auto & stream : streams) {
+                    stream << "\tNA";
+                }
+                continue;
+            }
+            for (ulong m = 0; m < nmethods; m++) {
+                scores[m].assign(1, score_genesets(score[m], col, genesets));
+            }
+            count_nulls(
+                col, score, c + 1, methods, counts, scores, min_observations,
+                max_iterations, observed, tested
+            );
+            for (ulong m = 0; m < nmethods; m++) {
+                streams[m] << "\t";
+                if (tested[m][0] == 0) {
+                    streams[m] << "1";
+                } else {
+                    streams[m] << exact_pvalue(observed[m][0], tested[m][0]);
+                }
+            }
         }
+        for (auto & stream : streams) {
+            stream << "\n" << std::flush;
+        }
+
+        // Display a period for each condition.
+        done++;
+        _log << '.' << std::flush;
+        if (done %  5 == 0) _log << ' ' << std::flush;
+        if (done % 10 == 0) _log << ' ' << std::flush;
+        if (done % 50 == 0) _log << done << std::endl;
     }
-    // Remove the condition columns from the matrix.
-    removeColumns(idxs, matrix);
-    // Remove the condition column names. Sort descending, then delete them.
-    std::sort(idxs.begin(), idxs.end(), std::greater<int>());
-    for (auto idx : idxs) {
-        new_col_names.erase(new_col_names.begin() + idx);
+    _log << '\n' << std::flush;
+    for (auto & stream : streams) {
+        stream.close();
     }
-    // Replace the old column names with new ones.
-    _col_names = new_col_names;
+
+    // Point back at the gene matrix without conditions.
+    point_gene_matrix();
+
+    _log << timestamp() << " # done." << std::endl;
 }
 
-void snpsea::bin_genesets(ulong slop, ulong max_genes)
+void snpsea::bin_genesets(ulong max_genes)
 {
-    for (const auto & item : _snp_intervals) {
-        std::string snp = item.first;
+    // Clear out the bins of the previous --snp-intervals and --slop.
+    _geneset_bins.clear();
+    _null_snp_ids.clear();
+
+    for (size_t i = 0; i < _snp_intervals.size(); i++) {
+        std::string snp = _snp_intervals.name(i);
 
         // We want to sample from the list in "--null-snps".
         if (_null_snp_names.count(snp) == 0) continue;
 
-        std::vector<ulong> geneset = snp_geneset(snp, slop);
+        std::vector<ulong> geneset = snp_geneset(snp);
 
         // Put the geneset in a bin that corresponds to its size.
         ulong n_genes = geneset.size();
@@ -889,17 +1987,21 @@ void snpsea::bin_genesets(ulong slop, ulong max_genes)
             }
             // Indices used for lookup in the gene matrix.
             _geneset_bins[n_genes].push_back(geneset);
+
+            // Keep each SNP once for drawing random SNPs.
+            if (_snp_intervals.find(snp) == i) {
+                _null_snp_ids.push_back(i);
+            }
         }
     }
 }
 
 // Generate a vector of vectors. Each inner vector contains gene indices for
 // looking up rows in the gene matrix.
-std::vector<std::vector<ulong> > snpsea::matched_genesets()
+std::vector<std::vector<ulong> > snpsea::matched_genesets(
+    std::mt19937 & generator
+)
 {
-    // Standard Mersenne Twister random number generator.
-    static std::mt19937 generator;
-
     std::vector<std::vector<ulong> > genesets;
     for (auto s : _user_geneset_sizes) {
         // Uniform integer distribution.
@@ -914,128 +2016,127 @@ std::vector<std::vector<ulong> > snpsea::matched_genesets()
 }
 
 // Same as matched_genesets(), but pick gene sets randomly without matching.
-std::vector<std::vector<ulong> > snpsea::random_genesets(int n, ulong slop)
+// Each random SNP overlaps at least one gene.
+std::vector<std::vector<ulong> > snpsea::random_genesets(
+    int n,
+    std::mt19937 & generator
+)
 {
     std::vector<std::vector<ulong> > genesets;
-    // Get a list of random SNPs.
-    std::set<std::string> snps;
-    random_snps("random" + std::to_string(n), snps, slop);
-
-    for (auto snp : snps) {
-        auto geneset = snp_geneset(snp, slop);
-        if (geneset.size() > 0) {
-            genesets.push_back(geneset);
-        }
+    for (auto i : sample_null_snps(n, generator)) {
+        genesets.push_back(std::vector<ulong>(
+            _snp_genes.begin() + _snp_gene_offsets[i],
+            _snp_genes.begin() + _snp_gene_offsets[i + 1]
+        ));
     }
     return genesets;
 }
 
 // Returns a score for a column in the binary gene matrix, requiring only one
-// gene in the given set to be present in the column for each gene set.
+// gene in the given gene set to be present in the column.
 double snpsea::score_binary_single(
     const ulong & col,
-    const std::vector<std::vector<ulong> > & genesets
+    const std::vector<ulong> & geneset
 )
 {
     ulong n = _binary_sums(col);
-    double p = _binary_probs(col);
-    double score = 0.0;
-    for (auto geneset : genesets) {
-        unsigned int k = 0;
-        for (auto gene_id : geneset) {
-            if (_gene_matrix(gene_id, col) > 0) {
-                k++;
-                break;
-            }
-        }
-        if (k > 0) {
-            // Use the hypergeometric distribution to calculate a probability.
-            unsigned int n1 = n;
-            unsigned int n2 = _nrows - n;
-            unsigned int t = geneset.size();
-            // k  = number of 1s in this geneset (set to 0)
-            // n1 = number of 1s in this column
-            // n2 = number of 0s in this column
-            // t  = number of genes in this geneset
-            // p(k) = C(n1, k) C(n2, t - k) / C(n1 + n2, t)
-            score += -log(1.0 - gsl_ran_hypergeometric_pdf(0, n1, n2, t));
+    unsigned int k = 0;
+    for (auto gene_id : geneset) {
+        if (_gene_matrix(gene_id, col) > 0) {
+            k++;
+            break;
         }
     }
-    return std::isfinite(score) ? score : 0.0;
+    if (k == 0) {
+        return 0.0;
+    }
+    // Use the hypergeometric distribution to calculate a probability.
+    unsigned int n1 = n;
+    unsigned int n2 = _nrows - n;
+    unsigned int t = geneset.size();
+    // k  = number of 1s in this geneset (set to 0)
+    // n1 = number of 1s in this column
+    // n2 = number of 0s in this column
+    // t  = number of genes in this geneset
+    // p(k) = C(n1, k) C(n2, t - k) / C(n1 + n2, t)
+    return -log(1.0 - gsl_ran_hypergeometric_pdf(0, n1, n2, t));
 }
 
 // Returns a score for a column in the binary gene matrix, considering the
-// total number of genes present in the column for each gene set.
+// total number of genes present in the column for the gene set.
 double snpsea::score_binary_total(
     const ulong & col,
-    const std::vector<std::vector<ulong> > & genesets
+    const std::vector<ulong> & geneset
 )
 {
     ulong n = _binary_sums(col);
-    double p = _binary_probs(col);
-    double score = 0.0;
-    for (auto geneset : genesets) {
-        unsigned int k = 0;
-        for (auto gene_id : geneset) {
-            if (_gene_matrix(gene_id, col) > 0) {
-                k++;
-            }
+    unsigned int k = 0;
+    for (auto gene_id : geneset) {
+        if (_gene_matrix(gene_id, col) > 0) {
+            k++;
         }
-        // Use the hypergeometric distribution to calculate a probability.
-        unsigned int n1 = n;
-        unsigned int n2 = _nrows - n;
-        unsigned int t = geneset.size();
-        // k  = number of 1s in this geneset
-        // n1 = number of 1s in this column
-        // n2 = number of 0s in this column
-        // t  = number of genes in this geneset
-        // p(k) = C(n1, k) C(n2, t - k) / C(n1 + n2, t)
-        if (k > 0) {
-            // Upper tail: Q(k) = \sum_{i > k} p(i)
-            score += -log(gsl_cdf_hypergeometric_Q(k - 1, n1, n2, t));
-        }
-    }
-    return std::isfinite(score) ? score : 0.0;
+    }
+    if (k == 0) {
+        return 0.0;
+    }
+    // Use the hypergeometric distribution to calculate a probability.
+    unsigned int n1 = n;
+    unsigned int n2 = _nrows - n;
+    unsigned int t = geneset.size();
+    // k  = number of 1s in this geneset
+    // n1 = number of 1s in this column
+    // n2 = number of 0s in this column
+    // t  = number of genes in this geneset
+    // p(k) = C(n1, k) C(n2, t - k) / C(n1 + n2, t)
+    // Upper tail: Q(k) = \sum_{i > k} p(i)
+    return -log(gsl_cdf_hypergeometric_Q(k - 1, n1, n2, t));
 }
 
 // Returns a score for a column in the quantitative gene matrix using
-// the single most specific gene in the given set of gene sets.
+// the single most specific gene in the given gene set.
 double snpsea::score_quantitative_single(
     const ulong & col,
-    const std::vector<std::vector<ulong> > & genesets
+    const std::vector<ulong> & geneset
 )
 {
-    double score = 0.0;
-    for (auto geneset : genesets) {
-        // Find the single gene with the greatest specificity to the column.
-        double percentile = 1.0;
-        for (auto gene_id : geneset) {
-            percentile = std::min(percentile, _gene_matrix(gene_id, col));
-        }
-        if (percentile < 1.0) {
-            // Each gene set contributes to the score.
-            score += -log(1 - pow(1 - percentile, geneset.size()));
-        }
+    // Find the single gene with the greatest specificity to the column.
+    double percentile = 1.0;
+    for (auto gene_id : geneset) {
+        percentile = std::min(percentile, _gene_matrix(gene_id, col));
+    }
+    if (percentile < 1.0) {
+        return -log(1 - pow(1 - percentile, geneset.size()));
     }
-    return std::isfinite(score) ? score : 0.0;
+    return 0.0;
 }
 
 // Returns a score for a column in the quantitative gene matrix using
-// all of the genes in the given set of gene sets.
+// all of the genes in the given gene set.
 double snpsea::score_quantitative_total(
+    const ulong & col,
+    const std::vector<ulong> & geneset
+)
+{
+    double score = 0.0;
+    // Use the specificity percentiles from all genes.
+    for (auto gene_id : geneset) {
+        score += -log(_gene_matrix(gene_id, col));
+    }
+    // Gamma(shape, scale)
+    return -log(gsl_cdf_gamma_Q(score, geneset.size(), 1.0));
+}
+
+// Each gene set contributes to the score of a set of gene sets. The score
+// is 0 if any of them has an infinite score.
+double snpsea::score_genesets(
+    score_function score,
     const ulong & col,
     const std::vector<std::vector<ulong> > & genesets
 )
 {
     double total = 0.0;
-    for (auto geneset : genesets) {
-        double score = 0.0;
-        // Use the specificity percentiles from all genes.
-        for (auto gene_id : geneset) {
-            score += -log(_gene_matrix(gene_id, col));
-        }
-        // Gamma(shape, scale)
-        total += -log(gsl_cdf_gamma_Q(score, geneset.size(), 1.0));
+    for (const auto & geneset : genesets) {
+        total += (this->*score)(col, geneset);
     }
     return std::isfinite(total) ? total : 0.0;
 }
@@ -1090,132 +2191,553 @@ void snpsea::report_scores(
                    << min_gene << "\t"
                    << score << "\n";
         }
+        // Drop the pages we read if the gene matrix is in a mapped file.
+        _gene_store.release();
     }
     stream.close();
 
     _log << timestamp() << " # done." << std::endl;
 }
 
-void snpsea::calculate_pvalues(
-    std::string filename,
-    std::string score_method,
-    std::vector<std::vector<ulong> > genesets,
+// Return the scoring function for each of "single" or "total" and the kind
+// of gene matrix we have.
+std::vector<snpsea::score_function> snpsea::get_score_functions(
+    const std::vector<std::string> & score_methods
+)
+{
+    std::vector<score_function> functions;
+    for (const auto & method : score_methods) {
+        if (method == "total") {
+            functions.push_back(
+                _binary_gene_matrix ? &snpsea::score_binary_total
+                : &snpsea::score_quantitative_total
+            );
+        } else {
+            functions.push_back(
+                _binary_gene_matrix ? &snpsea::score_binary_single
+                : &snpsea::score_quantitative_single
+            );
+        }
+    }
+    return functions;
+}
+
+// Count the user's genesets of each size in each bin of _geneset_bins.
+// Exit if there is no bin for a size.
+std::vector<ulong> snpsea::count_bins(const std::vector<ulong> & sizes)
+{
+    std::vector<ulong> counts(_geneset_bins.size(), 0);
+    for (auto size : sizes) {
+        auto it = _geneset_bins.find(size);
+        if (it == _geneset_bins.end()) {
+            std::cerr << "ERROR: No SNPs in --null-snps overlap " << size
+                      << " genes, so we cannot match a SNP that does."
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        counts[std::distance(_geneset_bins.begin(), it)]++;
+    }
+    return counts;
+}
+
+// Test the scores of many traits in one column of the gene matrix against
+// null matched genesets. A trait takes bin_counts[t][b] genesets from bin b
+// of _geneset_bins, and is scored with score[methods[t]]. For each of its
+// scores, count the null scores at least as high, until min_observations of
+// them are, or we reach max_iterations. Scores of 0 are not tested.
+//
+// A null geneset is scored with each method when it is first drawn, and
+// kept in a table for each bin, so the null scores are sums of entries in
+// the tables. Once a column has drawn at least as many genesets from a bin
+// as it holds, the rest of the bin is scored at once. Iteration i
+// of the null takes the geneset in slot j of bin b at random, with a key for
+// the stream, the column, b, j and i, so every trait that takes j genesets
+// from bin b uses the same ones, whatever its method. We draw the slots of
+// each bin once and sum them once for each method, and each trait adds the
+// sums of its bins. The null scores of a trait are the same as when it is
+// tested alone, so each p-value is exact, but the p-values of traits tested
+// in the same column and stream are not independent. The results do not
+// depend on the number of threads.
+void snpsea::count_nulls(
+    ulong col,
+    const std::vector<score_function> & score,
+    ulong stream,
+    const std::vector<ulong> & methods,
+    const std::vector<std::vector<ulong> > & bin_counts,
+    const std::vector<std::vector<double> > & scores,
     long min_observations,
     long max_iterations,
-    long replicates
+    std::vector<std::vector<long> > & observed,
+    std::vector<std::vector<long> > & tested
 )
 {
-    static int replicate = -1;
-    replicate++;
+    ulong ntraits = bin_counts.size();
+    ulong nbins = _geneset_bins.size();
+    ulong nmethods = score.size();
 
-    // Set the appropriate scoring function.
-    auto score_function = &snpsea::score_quantitative_single;
-    if (score_method == "single") {
-        if (_binary_gene_matrix) {
-            score_function = &snpsea::score_binary_single;
-        }
-    } else if (score_method == "total") {
-        score_function = &snpsea::score_quantitative_total;
-        if (_binary_gene_matrix) {
-            score_function = &snpsea::score_binary_total;
-        }
+    std::vector<const std::vector<std::vector<ulong> > *> bins;
+    for (const auto & item : _geneset_bins) {
+        bins.push_back(&item.second);
     }
+    // The score of each geneset in each bin with each method, computed when
+    // it is first drawn, whether it has been, and how many have been.
+    std::vector<std::vector<std::vector<double> > > table(
+        nmethods, std::vector<std::vector<double> >(nbins)
+    );
+    std::vector<std::vector<std::vector<char> > > scored(
+        nmethods, std::vector<std::vector<char> >(nbins)
+    );
+    std::vector<std::vector<ulong> > n_scored(
+        nmethods, std::vector<ulong>(nbins, 0)
+    );
 
-    std::fstream stream;
-    if (replicates <= 1) {
-        // Overwrite the file.
-        stream.open(filename, std::fstream::out);
-        // Print the column names.
-        stream << "condition\tpvalue\tnulls_observed\tnulls_tested" << std::endl;
-    } else {
-        // Append to the file.
-        stream.open(filename, std::fstream::out | std::fstream::app);
+    // The scores of each trait in increasing order, the index of each one,
+    // and whether we are still testing it.
+    std::vector<std::vector<double> > sorted(ntraits);
+    std::vector<std::vector<ulong> > order(ntraits);
+    std::vector<std::vector<bool> > active(ntraits);
+    std::vector<ulong> n_active(ntraits, 0);
+    for (ulong t = 0; t < ntraits; t++) {
+        ulong n = scores[t].size();
+        observed[t].assign(n, 0);
+        tested[t].assign(n, 0);
+        order[t].resize(n);
+        std::iota(order[t].begin(), order[t].end(), 0);
+        std::sort(order[t].begin(), order[t].end(),
+            [&](ulong a, ulong b) { return scores[t][a] < scores[t][b]; });
+        for (auto k : order[t]) {
+            sorted[t].push_back(scores[t][k]);
+        }
+        active[t].resize(n);
+        for (ulong k = 0; k < n; k++) {
+            active[t][k] = scores[t][k] > 0;
+            n_active[t] += active[t][k];
+        }
     }
 
-    for (ulong col = 0; col < _gene_matrix.cols(); col++) {
-        // Shared across all threads.
-        double user_score = (*this.*score_function)(col, genesets);
+    ulong first = 0;
+    for (auto count : iterations(100, max_iterations)) {
+        // The traits we are still testing, and the most genesets any of them
+        // takes from each bin with each method.
+        std::vector<ulong> traits;
+        std::vector<std::vector<ulong> > slots(
+            nmethods, std::vector<ulong>(nbins, 0)
+        );
+        for (ulong t = 0; t < ntraits; t++) {
+            if (n_active[t] == 0) {
+                continue;
+            }
+            traits.push_back(t);
+            for (ulong b = 0; b < nbins; b++) {
+                slots[methods[t]][b] =
+                    std::max(slots[methods[t]][b], bin_counts[t][b]);
+            }
+        }
+        if (traits.empty()) {
+            break;
+        }
 
-        // The user's SNPs scored 0, so don't bother testing.
-        if (user_score <= 0) {
-            stream << _col_names.at(col) << "\t1.0\t0\t0";
-            if (replicates > 1) {
-                stream << "\t" << replicate;
+        // The most slots of each bin for any method, which share the draws.
+        std::vector<ulong> draws(nbins, 0);
+        std::vector<std::vector<uint64_t> > keys(nbins);
+        for (ulong b = 0; b < nbins; b++) {
+            ulong n = bins[b]->size();
+            // The methods that draw from this bin and have not yet scored
+            // all of its genesets.
+            std::vector<ulong> need;
+            for (ulong m = 0; m < nmethods; m++) {
+                draws[b] = std::max(draws[b], slots[m][b]);
+                if (slots[m][b] > 0 && n_scored[m][b] < n) {
+                    if (table[m][b].empty()) {
+                        table[m][b].resize(n);
+                        scored[m][b].assign(n, 0);
+                    }
+                    need.push_back(m);
+                }
             }
-            stream << std::endl;
-            continue;
+            for (ulong j = 0; j < draws[b]; j++) {
+                keys[b].push_back(mix64(mix64(mix64(mix64(
+                    NULL_REPLICATE_SEED + stream) + col) + b) + j));
+            }
+            for (auto m : need) {
+                // The genesets this batch draws that have not been scored
+                // with this method, or the rest of the bin once the column
+                // has drawn at least as many as it holds.
+                std::vector<ulong> drawn;
+                if ((first + count) * draws[b] >= n) {
+                    for (ulong r = 0; r < n; r++) {
+                        if (!scored[m][b][r]) {
+                            scored[m][b][r] = 1;
+                            drawn.push_back(r);
+                        }
+                    }
+                } else {
+                    for (ulong i = first; i < first + count; i++) {
+                        for (ulong j = 0; j < slots[m][b]; j++) {
+                            ulong r = mix64(keys[b][j] + i) % n;
+                            if (!scored[m][b][r]) {
+                                scored[m][b][r] = 1;
+                                drawn.push_back(r);
+                            }
+                        }
+                    }
+                }
+                n_scored[m][b] += drawn.size();
+                #pragma omp parallel for
+                for (ulong k = 0; k < drawn.size(); k++) {
+                    table[m][b][drawn[k]] =
+                        (this->*score[m])(col, (*bins[b])[drawn[k]]);
+                }
+            }
+        }
+
+        // The number of null scores between consecutive sorted scores of
+        // each trait.
+        std::vector<std::vector<long> > counts(ntraits);
+        for (auto t : traits) {
+            counts[t].assign(sorted[t].size() + 1, 0);
         }
 
-        long nulls_tested = 0;
-        long nulls_observed = 0;
+        #pragma omp parallel
+        {
+            // Private to each thread.
+            std::vector<std::vector<long> > thread_counts(ntraits);
+            for (auto t : traits) {
+                thread_counts[t].assign(sorted[t].size() + 1, 0);
+            }
+            // The sums of the first j slots of each bin with each method.
+            std::vector<std::vector<std::vector<double> > > sums(
+                nmethods, std::vector<std::vector<double> >(nbins)
+            );
+            for (ulong m = 0; m < nmethods; m++) {
+                for (ulong b = 0; b < nbins; b++) {
+                    sums[m][b].assign(slots[m][b] + 1, 0.0);
+                }
+            }
 
-        for (auto count : iterations(100, max_iterations)) {
-            #pragma omp parallel
-            {
-                // Private to each thread.
-                long thread_observed = 0;
-
-                // Each thread will complete some fraction of this loop.
-                #pragma omp for
-                for (long i = 0; i < count; i++)
-                {
-                    // Call the appropriate scoring function.
-                    if ((*this.*score_function)(col, matched_genesets())
-                    >= user_score) {
-                        thread_observed += 1;
+            #pragma omp for
+            for (ulong i = first; i < first + count; i++) {
+                for (ulong b = 0; b < nbins; b++) {
+                    ulong n = bins[b]->size();
+                    for (ulong j = 0; j < draws[b]; j++) {
+                        ulong r = mix64(keys[b][j] + i) % n;
+                        for (ulong m = 0; m < nmethods; m++) {
+                            if (j < slots[m][b]) {
+                                sums[m][b][j + 1] =
+                                    sums[m][b][j] + table[m][b][r];
+                            }
+                        }
                     }
                 }
-
-                // Each thread counts its own results, then we sum them.
-                #pragma omp critical
-                {
-                    nulls_observed += thread_observed;
+                for (auto t : traits) {
+                    double null_score = 0.0;
+                    for (ulong b = 0; b < nbins; b++) {
+                        null_score += sums[methods[t]][b][bin_counts[t][b]];
+                    }
+                    if (!std::isfinite(null_score)) {
+                        null_score = 0.0;
+                    }
+                    thread_counts[t][std::upper_bound(
+                        sorted[t].begin(), sorted[t].end(), null_score
+                    ) - sorted[t].begin()]++;
                 }
             }
-            // Count how many total iterations we performed.
-            nulls_tested += count;
 
-            // A null SNP set scored higher than the user's SNP set enough
-            // times that we are confident in the column's p-value.
-            if (nulls_observed >= min_observations) {
-                break;
+            // Each thread counts its own results, then we sum them.
+            #pragma omp critical
+            {
+                for (auto t : traits) {
+                    for (ulong q = 0; q < counts[t].size(); q++) {
+                        counts[t][q] += thread_counts[t][q];
+                    }
+                }
+            }
+        }
+        first += count;
+
+        // The null scores at least as high as the score at sorted position
+        // q are those counted after q.
+        for (auto t : traits) {
+            long above = 0;
+            for (ulong q = sorted[t].size(); q-- > 0; ) {
+                above += counts[t][q + 1];
+                ulong k = order[t][q];
+                if (!active[t][k]) {
+                    continue;
+                }
+                observed[t][k] += above;
+                tested[t][k] += count;
+                // A null SNP set scored higher than this score enough times
+                // that we are confident in its p-value.
+                if (observed[t][k] >= min_observations) {
+                    active[t][k] = false;
+                    n_active[t]--;
+                }
             }
         }
+    }
+}
+
+// Calculate p-values for the genesets of each trait with each score
+// method, and write them to condition_pvalues.txt in the trait's folder, or
+// to a file for each method if there are many. Columns where a trait scored
+// 0 are not tested.
+void snpsea::calculate_pvalues(
+    const std::vector<std::string> & folders,
+    const std::vector<std::string> & score_methods,
+    const std::vector<std::vector<std::vector<ulong> > > & genesets,
+    const std::vector<std::vector<ulong> > & bin_counts,
+    long min_observations,
+    long max_iterations
+)
+{
+    // Set the appropriate scoring functions.
+    std::vector<score_function> score = get_score_functions(score_methods);
+
+    // Each trait is tested once with each method, as item m * ntraits + t.
+    ulong ntraits = folders.size();
+    ulong nitems = score.size() * ntraits;
+    ulong ncols = _gene_matrix.cols();
+
+    std::vector<ulong> methods;
+    std::vector<std::vector<ulong> > item_bin_counts;
+    for (ulong m = 0; m < score.size(); m++) {
+        for (ulong t = 0; t < ntraits; t++) {
+            methods.push_back(m);
+            item_bin_counts.push_back(bin_counts[t]);
+        }
+    }
 
-        // Exact Monte Carlo p-value. See page 6.
-        //
-        //     Phipson, B. & Smyth, G. K. Permutation P-values should never be
-        //     zero: calculating exact P-values when permutations are randomly
-        //     drawn. Statistical Applications in Genetics and Molecular
-        //     Biology 9, (2010).
-        double pvalue = (double(nulls_observed) + 1.0)
-                        / (double(nulls_tested) + 1.0);
+    // The counts of each item in each column.
+    std::vector<std::vector<long> > nulls_observed(nitems);
+    std::vector<std::vector<long> > nulls_tested(nitems);
+    std::vector<std::vector<double> > scores(nitems);
+    std::vector<std::vector<long> > observed(nitems), tested(nitems);
 
-        stream << _col_names.at(col) << '\t' << pvalue << '\t'
-               << nulls_observed << '\t' << nulls_tested;
+    for (ulong col = 0; col < ncols; col++) {
+        for (ulong k = 0; k < nitems; k++) {
+            scores[k].assign(
+                1, score_genesets(score[methods[k]], col, genesets[k % ntraits])
+            );
+        }
+        count_nulls(
+            col, score, 0, methods, item_bin_counts, scores,
+            min_observations, max_iterations, observed, tested
+        );
+        for (ulong k = 0; k < nitems; k++) {
+            nulls_observed[k].push_back(observed[k][0]);
+            nulls_tested[k].push_back(tested[k][0]);
+        }
 
         // Display a period for each column.
-        if (replicates > 1) {
-            stream << '\t' << replicate;
-        } else {
-            _log << '.' << std::flush;
-            if ((col + 1) %  5 == 0) _log << ' ' << std::flush;
-            if ((col + 1) % 10 == 0) _log << ' ' << std::flush;
-            if ((col + 1) % 50 == 0) _log << col + 1 << std::endl;
+        _log << '.' << std::flush;
+        if ((col + 1) %  5 == 0) _log << ' ' << std::flush;
+        if ((col + 1) % 10 == 0) _log << ' ' << std::flush;
+        if ((col + 1) % 50 == 0) _log << col + 1 << std::endl;
+
+        // Drop the pages of this column if the gene matrix is in a mapped
+        // file.
+        _gene_store.release(col, 1);
+    }
+    _log << '\n' << std::flush;
+
+    for (ulong k = 0; k < nitems; k++) {
+        std::ofstream stream(score_filename(
+            folders[k % ntraits] + "/condition_pvalues", score_methods,
+            methods[k]
+        ));
+        // Print the column names.
+        stream << "condition\tpvalue\tnulls_observed\tnulls_tested\n";
+        for (ulong col = 0; col < ncols; col++) {
+            // The user's SNPs scored 0, so they were not tested.
+            if (nulls_tested[k][col] == 0) {
+                stream << _col_names.at(col) << "\t1.0\t0\t0\n";
+                continue;
+            }
+            long observed = nulls_observed[k][col];
+            long tested = nulls_tested[k][col];
+            stream << _col_names.at(col) << '\t'
+                   << exact_pvalue(observed, tested) << '\t'
+                   << observed << '\t' << tested << '\n';
+        }
+        stream.close();
+    }
+}
+
+// Calculate p-values for null SNP sets, as if each one were the user's.
+// With n_random_snps > 0, each set has that many random SNPs, otherwise it
+// is matched to the user's genesets. Each replicate draws its SNPs with its
+// own generator seeded with its index.
+//
+// The null distribution of a column is the same for every replicate, so
+// count_nulls() tests them all against the same null scores, which are
+// also those of the user's p-values. A replicate finds the number of null
+// scores at least as high as its own with a binary search, and stops after
+// the same batch as the user's p-value would. This costs O(replicates +
+// iterations) scores for each column instead of O(replicates * iterations).
+// Each score method tests the same replicates against the same draws.
+//
+// For each column, write the proportion of p-values below each threshold
+// in TYPE1_THRESHOLDS to type1error.txt in out_folder. With write_pvalues,
+// also write every p-value to null_pvalues.txt, in replicate order with the
+// index in the fifth column. The counts are kept in a file in out_folder
+// until then, so the memory we use does not grow with the number of
+// replicates and columns. With many score methods, each one has its own
+// files. The results do not depend on the number of threads.
+void snpsea::null_pvalues(
+    std::string out_folder,
+    bool write_pvalues,
+    const std::vector<std::string> & score_methods,
+    int n_random_snps,
+    long replicates,
+    long min_observations,
+    long max_iterations
+)
+{
+    std::vector<score_function> score = get_score_functions(score_methods);
+    ulong nmethods = score.size();
+
+    // Draw the SNPs of each replicate.
+    std::vector<std::vector<std::vector<ulong> > > genesets(replicates);
+    for (long replicate = 0; replicate < replicates; replicate++) {
+        std::seed_seq seq{NULL_REPLICATE_SEED, (unsigned) replicate};
+        std::mt19937 generator(seq);
+
+        genesets[replicate] = n_random_snps > 0
+            ? random_genesets(n_random_snps, generator)
+            : matched_genesets(generator);
+    }
+
+    std::vector<std::ofstream> type1(nmethods);
+    for (ulong m = 0; m < nmethods; m++) {
+        type1[m].open(
+            score_filename(out_folder + "/type1error", score_methods, m)
+        );
+        type1[m] << "condition\treplicates";
+        for (auto alpha : TYPE1_THRESHOLDS) {
+            type1[m] << "\tp<" << alpha;
         }
+        type1[m] << '\n';
+    }
 
-        stream << '\n' << std::flush;
+    ulong ncols = _gene_matrix.cols();
+
+    // The counts of each method, with a row for each replicate and the
+    // observed and tested counts of each column, if we write them all.
+    std::vector<MappedMatrix> all_counts(nmethods);
+    if (write_pvalues) {
+        for (ulong m = 0; m < nmethods; m++) {
+            all_counts[m].create(out_folder, replicates, 2 * ncols);
+        }
     }
 
-    // Display a period for each replicate.
-    if (replicates > 1) {
+    // The replicates are tested like the scores of one trait for each
+    // method.
+    std::vector<ulong> methods(nmethods);
+    std::iota(methods.begin(), methods.end(), 0);
+    std::vector<std::vector<double> > scores(nmethods);
+    std::vector<std::vector<ulong> > counts(
+        nmethods, count_bins(_user_geneset_sizes)
+    );
+    std::vector<std::vector<long> > col_observed(nmethods);
+    std::vector<std::vector<long> > col_tested(nmethods);
+
+    for (ulong col = 0; col < ncols; col++) {
+        for (ulong m = 0; m < nmethods; m++) {
+            scores[m].resize(replicates);
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for (long replicate = 0; replicate < replicates; replicate++) {
+            for (ulong m = 0; m < nmethods; m++) {
+                scores[m][replicate] =
+                    score_genesets(score[m], col, genesets[replicate]);
+            }
+        }
+        count_nulls(
+            col, score, 0, methods, counts, scores, min_observations,
+            max_iterations, col_observed, col_tested
+        );
+
+        for (ulong m = 0; m < nmethods; m++) {
+            const std::vector<long> & observed = col_observed[m];
+            const std::vector<long> & tested = col_tested[m];
+
+            // Count the p-values below each threshold. Untested replicates
+            // have a p-value of 1.
+            std::vector<long> below(TYPE1_THRESHOLDS.size(), 0);
+            for (long replicate = 0; replicate < replicates; replicate++) {
+                double pvalue = 1.0;
+                if (tested[replicate] > 0) {
+                    pvalue =
+                        exact_pvalue(observed[replicate], tested[replicate]);
+                }
+                for (ulong t = 0; t < TYPE1_THRESHOLDS.size(); t++) {
+                    below[t] += pvalue < TYPE1_THRESHOLDS[t];
+                }
+                if (write_pvalues) {
+                    all_counts[m].col(2 * col)[replicate] =
+                        observed[replicate];
+                    all_counts[m].col(2 * col + 1)[replicate] =
+                        tested[replicate];
+                }
+            }
+            // Write this column's counts back to the file.
+            all_counts[m].release(2 * col, 2);
+            type1[m] << _col_names.at(col) << '\t' << replicates;
+            for (auto n : below) {
+                type1[m] << '\t' << double(n) / replicates;
+            }
+            type1[m] << '\n' << std::flush;
+        }
+
+        // Display a period for each column.
         _log << '.' << std::flush;
-        if ((replicate + 1) %  5 == 0) _log << ' ' << std::flush;
-        if ((replicate + 1) % 10 == 0) _log << ' ' << std::flush;
-        if ((replicate + 1) % 50 == 0) _log << replicate + 1 << std::endl;
-    } else {
-        _log << '\n' << std::flush;
+        if ((col + 1) %  5 == 0) _log << ' ' << std::flush;
+        if ((col + 1) % 10 == 0) _log << ' ' << std::flush;
+        if ((col + 1) % 50 == 0) _log << col + 1 << std::endl;
+
+        // Drop the pages of this column if the gene matrix is in a mapped
+        // file.
+        _gene_store.release(col, 1);
+    }
+    _log << '\n' << std::flush;
+    for (auto & stream : type1) {
+        stream.close();
     }
 
-    stream.close();
+    if (!write_pvalues) {
+        return;
+    }
+
+    // Read the counts for a block of replicates at a time, and drop the
+    // pages of each block when we are done with it.
+    long block = std::max(
+        1UL, NULL_PVALUES_BLOCK_BYTES / (2 * ncols * sizeof(double))
+    );
+    for (ulong m = 0; m < nmethods; m++) {
+        std::ofstream stream(
+            score_filename(out_folder + "/null_pvalues", score_methods, m)
+        );
+        for (long first = 0; first < replicates; first += block) {
+            long last = std::min(replicates, first + block);
+            for (long replicate = first; replicate < last; replicate++) {
+                for (ulong col = 0; col < ncols; col++) {
+                    long observed = all_counts[m].col(2 * col)[replicate];
+                    long tested = all_counts[m].col(2 * col + 1)[replicate];
+                    stream << _col_names.at(col) << '\t';
+                    if (tested == 0) {
+                        stream << "1.0";
+                    } else {
+                        stream << exact_pvalue(observed, tested);
+                    }
+                    stream << '\t' << observed << '\t' << tested << '\t'
+                           << replicate << '\n';
+                }
+            }
+            all_counts[m].release();
+        }
+        stream.close();
+        all_counts[m].close();
+    }
 }
@@ -0,0 +1,122 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+// snpsea-index: compress a BED file with BGZF and index it by the name in
+// the fourth column, so SNPsea can look up a few SNPs in --snp-intervals
+// without reading the whole file.
+
+#include "intervals.h"
+#include "bgzf.h"
+#include "lines.h"
+#include "snpsea.h"
+
+static void usage()
+{
+    std::cout <<
+        "Usage:\n"
+        "    snpsea-index in.bed.gz out.bed.gz\n"
+        "    snpsea-index file.bed.gz\n\n"
+        "Compress a (optionally gzipped) BED file with BGZF and write an\n"
+        "index of the names in its fourth column to out.bed.gz.idx. Pass the\n"
+        "BGZF file to snpsea with --snp-intervals and it will use the index.\n"
+        "\n"
+        "With a single argument, the file must already be compressed with\n"
+        "bgzip or snpsea-index, and only the index is written.\n\n"
+        "SNPsea " SNPSEA_VERSION "\n";
+}
+
+// Add an index entry for the name in the fourth column of a BED line.
+static bool add_entry(
+    const char * begin,
+    const char * end,
+    uint64_t voffset,
+    std::vector<BEDIndex::entry> & entries
+)
+{
+    BEDRow row;
+    if (!row.parse(begin, end) || row.name.size() == 0) {
+        return false;
+    }
+    entries.push_back(BEDIndex::entry(BEDIndex::hash(row.name), voffset));
+    return true;
+}
+
+int main(int argc, const char * argv[])
+{
+    if (argc < 2 || argc > 3 || argv[1][0] == '-') {
+        usage();
+        return 1;
+    }
+
+    std::string in_file = argv[1];
+    std::string out_file = argc == 3 ? argv[2] : argv[1];
+    assert_file_exists(in_file);
+
+    // Writing over the input while we read it would destroy it, so refuse
+    // an output that is the same file under any name.
+    struct stat in_stat, out_stat;
+    if (argc == 3 && stat(in_file.c_str(), &in_stat) == 0
+        && stat(out_file.c_str(), &out_stat) == 0
+        && in_stat.st_dev == out_stat.st_dev
+        && in_stat.st_ino == out_stat.st_ino) {
+        std::cerr << "ERROR: The output is the same file as the input "
+                  << in_file << std::endl
+                  << "Pass a different output file name, or only the input"
+                  << " if it is already compressed with BGZF." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<BEDIndex::entry> entries;
+    std::string line;
+    ulong skipped = 0;
+
+    if (argc == 3) {
+        // Compress the input one line at a time, noting where each line
+        // begins.
+        LineReader lines;
+        if (!lines.open(in_file)) {
+            std::cerr << "ERROR: Cannot open " + in_file << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        BGZFWriter writer;
+        if (!writer.open(out_file)) {
+            std::cerr << "ERROR: Cannot write " + out_file << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const char * begin, * end;
+        while (lines.next(begin, end)) {
+            uint64_t voffset = writer.write_line(begin, end - begin);
+            if (!add_entry(begin, end, voffset, entries)) {
+                skipped++;
+            }
+        }
+        writer.close();
+    } else {
+        // Index an existing BGZF file in place.
+        if (!is_bgzf(in_file)) {
+            std::cerr << "ERROR: Not a BGZF file " + in_file << std::endl
+                      << "Pass an output file name to compress it."
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        BGZFReader reader;
+        reader.open(in_file);
+        uint64_t voffset = reader.tell();
+        while (reader.getline(line)) {
+            if (!add_entry(line.data(), line.data() + line.size(), voffset,
+                           entries)) {
+                skipped++;
+            }
+            voffset = reader.tell();
+        }
+    }
+
+    BEDIndex::write(BEDIndex::filename(out_file), entries);
+
+    std::cout << "Indexed " << entries.size() << " lines of " + out_file;
+    if (skipped > 0) {
+        std::cout << " and skipped " << skipped << " lines without a name";
+    }
+    std::cout << "." << std::endl;
+    return 0;
+}
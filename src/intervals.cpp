@@ -0,0 +1,274 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "intervals.h"
+
+// The first bytes of an index file, followed by the version number.
+static const char BED_INDEX_MAGIC[8] = {
+    'S', 'N', 'P', 'S', 'E', 'A', 'I', 'X'
+};
+static const uint64_t BED_INDEX_VERSION = 1;
+
+bool SNPIntervalStore::parse_rsid(const char * s, size_t length, uint64_t & id)
+{
+    // "rs" followed by 1 to 18 digits, without a leading zero.
+    if (length < 3 || length > 20 || s[0] != 'r' || s[1] != 's'
+        || s[2] < '1' || s[2] > '9') {
+        return false;
+    }
+    id = 0;
+    for (size_t i = 2; i < length; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+        id = id * 10 + (s[i] - '0');
+    }
+    return true;
+}
+
+void SNPIntervalStore::insert(
+    StringRef name,
+    StringRef chrom,
+    ulong start,
+    ulong end
+)
+{
+    if (start > std::numeric_limits<uint32_t>::max()
+        || end > std::numeric_limits<uint32_t>::max()) {
+        std::cerr << "ERROR: Interval is out of range for " + name.str()
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    record r;
+    r.chrom = _chrom_names.id(chrom);
+    r.start = start;
+    r.end = end;
+    if (parse_rsid(name.data(), name.size(), r.key)) {
+        _pending_rsids.push_back(r);
+    } else {
+        r.key = _pending_names.size();
+        _pending_names.push_back(name.str());
+        _pending_named.push_back(r);
+    }
+}
+
+void SNPIntervalStore::finalize()
+{
+    // Intervals from an earlier finalize() are older than the pending ones,
+    // so they go first.
+    if (_starts.size() > 0) {
+        std::vector<record> rsids, named;
+        for (size_t i = 0; i < _rsids.size(); i++) {
+            record r = {_rsids[i], _chroms[i], _starts[i], _ends[i]};
+            rsids.push_back(r);
+        }
+        for (size_t i = 0; i < _names.size(); i++) {
+            size_t j = _rsids.size() + i;
+            record r = {
+                _pending_names.size(), _chroms[j], _starts[j], _ends[j]
+            };
+            _pending_names.push_back(_names[i]);
+            named.push_back(r);
+        }
+        rsids.insert(rsids.end(), _pending_rsids.begin(), _pending_rsids.end());
+        named.insert(named.end(), _pending_named.begin(), _pending_named.end());
+        _pending_rsids.swap(rsids);
+        _pending_named.swap(named);
+    }
+
+    // Sort each kind of name. A stable sort keeps duplicates in the order
+    // they were added, so we can keep the last one like std::map would.
+    const std::vector<std::string> & names = _pending_names;
+    std::stable_sort(
+        _pending_rsids.begin(), _pending_rsids.end(),
+        [] (const record & a, const record & b) { return a.key < b.key; }
+    );
+    std::stable_sort(
+        _pending_named.begin(), _pending_named.end(),
+        [&] (const record & a, const record & b) {
+            return names[a.key] < names[b.key];
+        }
+    );
+
+    _rsids.clear();
+    _names.clear();
+    _chroms.clear();
+    _starts.clear();
+    _ends.clear();
+
+    for (size_t i = 0; i < _pending_rsids.size(); i++) {
+        const record & r = _pending_rsids[i];
+        // Keep only the last of each run of equal keys.
+        if (i + 1 < _pending_rsids.size()
+            && _pending_rsids[i + 1].key == r.key) {
+            continue;
+        }
+        _rsids.push_back(r.key);
+        _chroms.push_back(r.chrom);
+        _starts.push_back(r.start);
+        _ends.push_back(r.end);
+    }
+    for (size_t i = 0; i < _pending_named.size(); i++) {
+        const record & r = _pending_named[i];
+        if (i + 1 < _pending_named.size()
+            && names[_pending_named[i + 1].key] == names[r.key]) {
+            continue;
+        }
+        _names.push_back(names[r.key]);
+        _chroms.push_back(r.chrom);
+        _starts.push_back(r.start);
+        _ends.push_back(r.end);
+    }
+
+    // Release the memory used while loading.
+    std::vector<record>().swap(_pending_rsids);
+    std::vector<record>().swap(_pending_named);
+    std::vector<std::string>().swap(_pending_names);
+    _rsids.shrink_to_fit();
+    _names.shrink_to_fit();
+    _chroms.shrink_to_fit();
+    _starts.shrink_to_fit();
+    _ends.shrink_to_fit();
+}
+
+void SNPIntervalStore::clear()
+{
+    std::vector<record>().swap(_pending_rsids);
+    std::vector<record>().swap(_pending_named);
+    std::vector<std::string>().swap(_pending_names);
+    std::vector<uint64_t>().swap(_rsids);
+    std::vector<std::string>().swap(_names);
+    std::vector<uint32_t>().swap(_chroms);
+    std::vector<uint32_t>().swap(_starts);
+    std::vector<uint32_t>().swap(_ends);
+    _chrom_names.clear();
+}
+
+size_t SNPIntervalStore::find(const std::string & name) const
+{
+    uint64_t id;
+    if (parse_rsid(name.data(), name.size(), id)) {
+        auto it = std::lower_bound(_rsids.begin(), _rsids.end(), id);
+        if (it != _rsids.end() && *it == id) {
+            return it - _rsids.begin();
+        }
+    } else {
+        auto it = std::lower_bound(_names.begin(), _names.end(), name);
+        if (it != _names.end() && *it == name) {
+            return _rsids.size() + (it - _names.begin());
+        }
+    }
+    return npos;
+}
+
+genomic_interval SNPIntervalStore::get(const std::string & name) const
+{
+    genomic_interval interval;
+    interval.start = 0;
+    interval.end = 0;
+    size_t i = find(name);
+    if (i != npos) {
+        interval.chrom = chrom(i);
+        interval.start = start(i);
+        interval.end = end(i);
+    }
+    return interval;
+}
+
+std::string SNPIntervalStore::name(size_t i) const
+{
+    if (i < _rsids.size()) {
+        return "rs" + std::to_string(_rsids[i]);
+    }
+    return _names[i - _rsids.size()];
+}
+
+void BEDIndex::write(
+    const std::string & filename,
+    std::vector<entry> & entries
+)
+{
+    std::sort(entries.begin(), entries.end());
+    std::ofstream stream(filename.c_str(), std::ios::binary);
+    uint64_t size = entries.size();
+    stream.write(BED_INDEX_MAGIC, sizeof(BED_INDEX_MAGIC));
+    stream.write((const char *) &BED_INDEX_VERSION, sizeof(uint64_t));
+    stream.write((const char *) &size, sizeof(uint64_t));
+    for (const auto & e : entries) {
+        stream.write((const char *) &e.first, sizeof(uint64_t));
+        stream.write((const char *) &e.second, sizeof(uint64_t));
+    }
+    if (!stream) {
+        std::cerr << "ERROR: Cannot write " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool BEDIndex::open(const std::string & filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 24) {
+        ::close(fd);
+        return false;
+    }
+    void * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    _map = map;
+    _map_size = st.st_size;
+
+    const uint64_t * header = (const uint64_t *) _map;
+    if (memcmp(_map, BED_INDEX_MAGIC, sizeof(BED_INDEX_MAGIC)) != 0
+        || header[1] != BED_INDEX_VERSION
+        || _map_size != 24 + header[2] * 2 * sizeof(uint64_t)) {
+        close();
+        return false;
+    }
+    _size = header[2];
+    _entries = header + 3;
+    return true;
+}
+
+void BEDIndex::close()
+{
+    if (_map != NULL) {
+        munmap(_map, _map_size);
+    }
+    _map = NULL;
+    _map_size = 0;
+    _entries = NULL;
+    _size = 0;
+}
+
+void BEDIndex::find(
+    const std::string & name,
+    std::vector<uint64_t> & voffsets
+) const
+{
+    uint64_t h = hash(name);
+    // Binary search for the first entry with this hash.
+    uint64_t lo = 0, hi = _size;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (_entries[2 * mid] < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < _size && _entries[2 * lo] == h; lo++) {
+        voffsets.push_back(_entries[2 * lo + 1]);
+    }
+}
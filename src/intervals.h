@@ -0,0 +1,172 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+#ifndef _INTERVALS_H
+#define _INTERVALS_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// A compact store of named genomic intervals, used for --snp-intervals.
+//
+// Names like "rs12345" are parsed into integers and all other names are kept
+// as strings. Chromosome names are stored once and referenced by an integer
+// id. After finalize(), the intervals are held in parallel arrays sorted by
+// name, and lookups are a binary search. Indices in [0, size()) refer to
+// entries in that sorted order.
+class SNPIntervalStore
+{
+public:
+    // Returned by find() when a name is absent.
+    static const size_t npos = static_cast<size_t>(-1);
+
+    // Add an interval. If a name is added twice, the last one is kept.
+    // Call finalize() after adding the last interval.
+    void insert(
+        StringRef name,
+        StringRef chrom,
+        ulong start,
+        ulong end
+    );
+
+    // Sort the intervals by name and drop duplicate names.
+    void finalize();
+
+    // Remove all intervals and chromosome names.
+    void clear();
+
+    // Return the index of the named interval, or npos if it is absent.
+    size_t find(const std::string & name) const;
+
+    // Return 1 if the named interval is present, otherwise 0.
+    size_t count(const std::string & name) const
+    {
+        return find(name) == npos ? 0 : 1;
+    }
+
+    // Return the named interval, or an empty interval if it is absent.
+    genomic_interval get(const std::string & name) const;
+
+    size_t size() const
+    {
+        return _starts.size();
+    }
+
+    std::string name(size_t i) const;
+
+    const std::string & chrom(size_t i) const
+    {
+        return _chrom_names.name(_chroms[i]);
+    }
+
+    ulong start(size_t i) const
+    {
+        return _starts[i];
+    }
+
+    ulong end(size_t i) const
+    {
+        return _ends[i];
+    }
+
+    // Parse a name like "rs12345" into 12345. Return false for any other
+    // name, including ones with leading zeros that would not round trip.
+    static bool parse_rsid(const char * s, size_t length, uint64_t & id);
+
+private:
+    // One interval waiting to be sorted by finalize(). For rsIDs, the key is
+    // the integer id. For other names, it is an offset into _pending_names.
+    struct record {
+        uint64_t key;
+        uint32_t chrom;
+        uint32_t start;
+        uint32_t end;
+    };
+
+    std::vector<record>
+    _pending_rsids,
+    _pending_named;
+
+    std::vector<std::string>
+    _pending_names;
+
+    // Sorted rsIDs. Entry i corresponds to index i.
+    std::vector<uint64_t>
+    _rsids;
+
+    // Sorted names that are not rsIDs. Entry i corresponds to index
+    // _rsids.size() + i.
+    std::vector<std::string>
+    _names;
+
+    // Structure of arrays with one entry for each index.
+    std::vector<uint32_t>
+    _chroms,
+    _starts,
+    _ends;
+
+    // Chromosome names and their ids in _chroms.
+    ChromInterner
+    _chrom_names;
+};
+
+// An index of a BGZF-compressed BED file, written by snpsea-index next to
+// the BED file. It has one entry for each line: a 64-bit hash of the name
+// in the fourth column and the virtual offset of the line, sorted by hash.
+// Hash collisions are resolved by reading the lines and checking the names.
+class BEDIndex
+{
+public:
+    // Hash of a name, virtual offset of its line.
+    typedef std::pair<uint64_t, uint64_t> entry;
+
+    BEDIndex() : _map(NULL), _map_size(0), _entries(NULL), _size(0) {}
+    ~BEDIndex() { close(); }
+
+    // Return the name of the index for a BED file.
+    static std::string filename(const std::string & bed_filename)
+    {
+        return bed_filename + ".idx";
+    }
+
+    static uint64_t hash(StringRef name)
+    {
+        return hash_bytes(name.data(), name.size());
+    }
+
+    // Sort the entries and write them to an index file.
+    static void write(
+        const std::string & filename,
+        std::vector<entry> & entries
+    );
+
+    // Map an index file into memory. Return false if it is not valid.
+    bool open(const std::string & filename);
+
+    void close();
+
+    // Return the number of lines in the indexed BED file.
+    uint64_t size() const
+    {
+        return _size;
+    }
+
+    // Append the virtual offsets of the lines that may have this name.
+    void find(
+        const std::string & name,
+        std::vector<uint64_t> & voffsets
+    ) const;
+
+private:
+    void * _map;
+    size_t _map_size;
+    // Pairs of (hash, virtual offset).
+    const uint64_t * _entries;
+    uint64_t _size;
+};
+
+#endif
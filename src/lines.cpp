@@ -0,0 +1,152 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "lines.h"
+
+const size_t LineReader::CHUNK_SIZE;
+
+// Return true if the file starts with the gzip magic number.
+static bool is_gzip(int fd)
+{
+    unsigned char magic[2];
+    return pread(fd, magic, 2, 0) == 2 && magic[0] == 31 && magic[1] == 139;
+}
+
+bool LineReader::open(const std::string & filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    // Map regular files that are not gzipped.
+    if (S_ISREG(st.st_mode) && !is_gzip(fd)) {
+        if (st.st_size > 0) {
+            void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            _map = map;
+            _map_size = st.st_size;
+            _pos = (const char *) _map;
+            _end = _pos + _map_size;
+            // The byte after the map may not be readable, so copy the last
+            // line if it has no newline.
+            if (_end[-1] != '\n') {
+                const char * last = _end - 1;
+                while (last > _pos && last[-1] != '\n') {
+                    last--;
+                }
+                _tail.assign(last, _end);
+                _tail_done = false;
+                _end = last;
+            }
+        }
+        ::close(fd);
+        return true;
+    }
+    ::close(fd);
+
+    _stream.open(filename.c_str());
+    return _stream.is_open();
+}
+
+void LineReader::close()
+{
+    if (_map != NULL) {
+        munmap(_map, _map_size);
+    }
+    _map = NULL;
+    _map_size = 0;
+    if (_stream.is_open()) {
+        _stream.close();
+    }
+    _stream.clear();
+    _chunk.clear();
+    _rest.clear();
+    _tail.clear();
+    _tail_done = true;
+    _pos = _end = NULL;
+}
+
+bool LineReader::fill()
+{
+    if (!_tail_done) {
+        _tail_done = true;
+        _pos = _tail.data();
+        _end = _pos + _tail.size();
+        return true;
+    }
+    if (_map != NULL || !_stream.is_open()) {
+        return false;
+    }
+    while (_stream) {
+        _chunk.swap(_rest);
+        size_t n = _chunk.size();
+        _chunk.resize(n + CHUNK_SIZE);
+        _stream.read(&_chunk[n], CHUNK_SIZE);
+        _chunk.resize(n + _stream.gcount());
+        if (_stream) {
+            // Keep the incomplete last line for the next chunk.
+            size_t last = _chunk.rfind('\n');
+            if (last == std::string::npos || last < n) {
+                _rest.swap(_chunk);
+                continue;
+            }
+            _rest.assign(_chunk, last + 1, std::string::npos);
+            _chunk.resize(last + 1);
+        } else {
+            _rest.clear();
+        }
+        if (_chunk.size() > 0) {
+            _pos = _chunk.data();
+            _end = _pos + _chunk.size();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LineReader::next(const char *& begin, const char *& end)
+{
+    if (_pos == _end && !fill()) {
+        return false;
+    }
+    begin = _pos;
+    const char * newline = (const char *) memchr(_pos, '\n', _end - _pos);
+    if (newline == NULL) {
+        end = _end;
+        _pos = _end;
+    } else {
+        end = newline;
+        _pos = newline + 1;
+    }
+    if (end > begin && end[-1] == '\r') {
+        end--;
+    }
+    return true;
+}
+
+bool LineReader::next_chunk(const char *& begin, const char *& end)
+{
+    if (_pos == _end && !fill()) {
+        return false;
+    }
+    begin = _pos;
+    end = _end;
+    _pos = _end;
+    return true;
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+#ifndef _LINES_H
+#define _LINES_H
+
+#include <string>
+
+#include "common.h"
+
+// Read a text file one line at a time without copying each line.
+//
+// Uncompressed files are mapped into memory and lines point straight into
+// the map. Gzipped files are inflated through gzifstream (with its
+// read-ahead thread) into large chunks that end on a line break. Either way,
+// the bytes are handed out in chunks of whole lines, and each chunk is
+// followed by a '\n' or a '\0', so parsers may scan one byte past a line
+// without checking for the end of the chunk.
+class LineReader
+{
+public:
+    // Size of the chunks read from gzipped files.
+    static const size_t CHUNK_SIZE = 1 << 24;
+
+    LineReader() : _map(NULL), _map_size(0), _tail_done(true),
+                   _pos(NULL), _end(NULL) {}
+    ~LineReader() { close(); }
+
+    // Open a file. Return false if it cannot be read.
+    bool open(const std::string & filename);
+
+    void close();
+
+    // Return true if the file is mapped into memory. The lines of a mapped
+    // file stay valid until close().
+    bool mapped() const
+    {
+        return _map != NULL;
+    }
+
+    // Point to the next line, without its newline or a trailing '\r'.
+    // Return false at the end of the file. Unless the file is mapped, the
+    // line is only valid until the next call.
+    bool next(const char *& begin, const char *& end);
+
+    // Point to the rest of the current chunk, or the next chunk, of whole
+    // lines. Each line but the last of the file ends with '\n'. Return false
+    // at the end of the file.
+    bool next_chunk(const char *& begin, const char *& end);
+
+    // Parse the next line into a row of tab-delimited cells.
+    bool next(Row & row)
+    {
+        const char * begin, * end;
+        if (!next(begin, end)) {
+            return false;
+        }
+        row.parse(begin, end);
+        return true;
+    }
+
+    // Parse the next line that holds an interval.
+    bool next(BEDRow & row)
+    {
+        const char * begin, * end;
+        while (next(begin, end)) {
+            if (row.parse(begin, end)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    // Read the next chunk. Return false at the end of the file.
+    bool fill();
+
+    // Memory map of an uncompressed file.
+    void * _map;
+    size_t _map_size;
+
+    // Gzipped files are read in chunks. The last incomplete line of a
+    // chunk is moved to the start of the next one.
+    gzifstream _stream;
+    std::string _chunk, _rest;
+
+    // A mapped file that does not end with a newline has its last line
+    // copied here, so it can be followed by a '\0' like the others.
+    std::string _tail;
+    bool _tail_done;
+
+    // The unread part of the current chunk.
+    const char * _pos, * _end;
+};
+
+#endif
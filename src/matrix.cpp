@@ -0,0 +1,742 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "matrix.h"
+#include "lines.h"
+
+// The first bytes of a packed matrix, followed by the version number.
+static const char PACKED_MATRIX_MAGIC[8] = {
+    'S', 'N', 'P', 'S', 'E', 'A', 'M', 'X'
+};
+static const uint64_t PACKED_MATRIX_VERSION = 1;
+
+// Values start at a multiple of this many bytes.
+static const uint64_t PACKED_MATRIX_ALIGN = 64;
+
+// The header of a packed matrix, followed by the names at offset 64.
+struct packed_matrix_header {
+    char magic[8];
+    uint64_t version;
+    uint64_t kind;
+    uint64_t rows;
+    uint64_t cols;
+    // Bytes in the table of names.
+    uint64_t names_size;
+    // Offset of the values from the start of the file.
+    uint64_t data_offset;
+    uint64_t reserved;
+};
+
+ColumnSelection::ColumnSelection(
+    const std::string & arg,
+    const std::string & flag
+)
+    : _flag(flag)
+{
+    if (arg.length() == 0) {
+        return;
+    }
+    // A folder like "." is a regular expression, not a list.
+    struct stat st;
+    if (stat(arg.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+        LineReader lines;
+        lines.open(arg);
+        Row row;
+        while (lines.next(row)) {
+            if (row.size() > 0 && row[0].size() > 0 && row[0][0] != '#') {
+                _names.insert(row[0].str());
+            }
+        }
+        if (_names.empty()) {
+            std::cerr << "ERROR: No columns found in " + arg << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    _pattern = arg;
+    regex_t * regex = new regex_t;
+    int error = regcomp(regex, arg.c_str(), REG_EXTENDED | REG_NOSUB);
+    if (error != 0) {
+        char message[256];
+        regerror(error, regex, message, sizeof(message));
+        std::cerr << "ERROR: " + _flag + " " + arg + " is not a file or a"
+                  << " valid regular expression: " << message << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    _regex.reset(regex, [] (regex_t * r) { regfree(r); delete r; });
+}
+
+std::vector<bool> ColumnSelection::select(
+    const std::vector<std::string> & col_names
+) const
+{
+    std::vector<bool> keep(col_names.size(), all());
+    if (all()) {
+        return keep;
+    }
+    std::set<std::string> found;
+    ulong n_kept = 0;
+    for (size_t i = 0; i < col_names.size(); i++) {
+        if (_regex) {
+            keep[i] = regexec(_regex.get(), col_names[i].c_str(), 0, NULL, 0)
+                      == 0;
+        } else if (_names.count(col_names[i]) > 0) {
+            keep[i] = true;
+            found.insert(col_names[i]);
+        }
+        n_kept += keep[i];
+    }
+    if (found.size() < _names.size()) {
+        std::cerr << "ERROR: Columns not found in --gene-matrix file:"
+                  << std::endl;
+        for (const auto & name : _names) {
+            if (found.count(name) == 0) {
+                std::cerr << name << std::endl;
+            }
+        }
+        exit(EXIT_FAILURE);
+    }
+    if (n_kept == 0) {
+        std::cerr << "ERROR: " + _flag + " " + _pattern + " matches none of the"
+                  << " columns in --gene-matrix" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return keep;
+}
+
+// Open a GCT file and read its first three lines: the version, the number
+// of rows and columns, and the column names. Exit if they are malformed.
+static void read_gct_header(
+    const std::string & filename,
+    LineReader & lines,
+    ulong & rows,
+    std::vector<std::string> & col_names
+)
+{
+    if (!lines.open(filename)) {
+        std::cerr << "ERROR: Cannot open " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Check that the first line is correct.
+    const char * begin, * end;
+    if (!lines.next(begin, end) || std::string(begin, end).find("#1.2") != 0) {
+        std::cerr << "ERROR: Not a GCT file " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Read the number of rows and columns.
+    ulong cols = 0;
+    rows = 0;
+    if (lines.next(begin, end)) {
+        char * p;
+        rows = strtoul(begin, &p, 10);
+        cols = strtoul(p, &p, 10);
+    }
+
+    if (rows <= 0 || cols <= 0) {
+        std::cerr << "ERROR: Line 2 of GCT file is malformed " + filename
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Read the column names after "Name" and "Description".
+    col_names.clear();
+    if (lines.next(begin, end)) {
+        std::vector<std::string> names = split_string(
+            std::string(begin, end), '\t'
+        );
+        if (names.size() >= cols + 2) {
+            col_names.assign(names.begin() + 2, names.begin() + 2 + cols);
+        }
+    }
+    if (col_names.size() != cols) {
+        std::cerr << "ERROR: Line 3 of GCT file is malformed " + filename
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void read_matrix_size(
+    const std::string & filename,
+    const ColumnSelection & columns,
+    ulong & rows,
+    ulong & cols
+)
+{
+    std::vector<std::string> col_names;
+    if (PackedMatrix::is_packed(filename)) {
+        PackedMatrix matrix;
+        if (!matrix.open(filename)) {
+            std::cerr << "ERROR: Not a valid packed matrix " + filename
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        rows = matrix.rows();
+        col_names = matrix.col_names();
+    } else {
+        LineReader lines;
+        read_gct_header(filename, lines, rows, col_names);
+    }
+    std::vector<bool> keep = columns.select(col_names);
+    cols = std::count(keep.begin(), keep.end(), true);
+}
+
+// Find the position of each column among the ones kept by the selection,
+// or -1 to skip it, and the names of the kept columns.
+static void select_slots(
+    const std::vector<std::string> & all_col_names,
+    const ColumnSelection & columns,
+    std::vector<std::string> & col_names,
+    std::vector<long> & slots
+)
+{
+    std::vector<bool> keep = columns.select(all_col_names);
+    slots.assign(all_col_names.size(), -1);
+    col_names.clear();
+    for (size_t c = 0; c < all_col_names.size(); c++) {
+        if (keep[c]) {
+            slots[c] = col_names.size();
+            col_names.push_back(all_col_names[c]);
+        }
+    }
+}
+
+// Parse the rows of a GCT file after its header, buffering at most
+// batch_bytes of values at a time. Each batch is parsed in parallel into a
+// column-major buffer, then handed to store(first, n, values, stride),
+// where kept column j of rows [first, first + n) starts at
+// values + j * stride.
+template <class Store>
+static void read_gct_rows(
+    const std::string & filename,
+    LineReader & lines,
+    const std::vector<long> & slots,
+    ulong n_kept,
+    ulong batch_bytes,
+    std::vector<std::string> & row_names,
+    VectorXd & row_norms,
+    Store store
+)
+{
+    ulong rows = row_names.size();
+    ulong cols = slots.size();
+
+    ulong batch_rows = batch_bytes / sizeof(double) / std::max(1UL, n_kept);
+    batch_rows = std::max(1UL, std::min(batch_rows, rows));
+    std::vector<double> values(batch_rows * n_kept);
+    row_norms.resize(rows);
+
+    // Offsets of the start of each line in the chunk, and one past the end.
+    std::vector<size_t> offsets;
+    const char * begin, * end;
+    ulong r = 0;
+    while (r < rows && lines.next_chunk(begin, end)) {
+        offsets.clear();
+        size_t size = end - begin;
+        for (size_t i = 0; i < size && r + offsets.size() < rows; ) {
+            offsets.push_back(i);
+            const char * newline =
+                (const char *) memchr(begin + i, '\n', size - i);
+            i = newline == NULL ? size : newline - begin + 1;
+        }
+        offsets.push_back(size);
+
+        for (ulong first = 0; first + 1 < offsets.size();
+             first += batch_rows) {
+            // The first row in this batch that we could not parse.
+            long bad = -1;
+            long n_lines = std::min(batch_rows, offsets.size() - 1 - first);
+
+            #pragma omp parallel for
+            for (long i = 0; i < n_lines; i++) {
+                const char * p = begin + offsets[first + i];
+                const char * line_end = begin + offsets[first + i + 1];
+                const char * tab =
+                    (const char *) memchr(p, '\t', line_end - p);
+                // Skip the Description column.
+                const char * tab2 = tab == NULL ? NULL
+                    : (const char *) memchr(tab + 1, '\t', line_end - tab - 1);
+                bool ok = tab2 != NULL;
+                if (ok) {
+                    row_names[r + first + i].assign(p, tab);
+                    p = tab2 + 1;
+                }
+                // Every value counts toward the norm of the row, but we only
+                // store the kept ones.
+                double x, norm = 0;
+                for (ulong c = 0; ok && c < cols; c++) {
+                    ok = p < line_end && parse_double(p, &p, x)
+                         && (*p == '\t' || *p == ' ' || *p == '\n'
+                             || *p == '\r' || p == line_end);
+                    norm += x * x;
+                    if (slots[c] >= 0) {
+                        values[slots[c] * batch_rows + i] = x;
+                    }
+                }
+                // Nothing but blanks may follow the last value.
+                while (ok && p < line_end && (*p == '\t' || *p == ' ')) {
+                    p++;
+                }
+                ok = ok && (p == line_end || *p == '\n' || *p == '\r');
+                row_norms[r + first + i] = std::sqrt(norm);
+                if (!ok) {
+                    #pragma omp critical
+                    if (bad < 0 || i < bad) {
+                        bad = i;
+                    }
+                }
+            }
+
+            if (bad >= 0) {
+                std::cerr << "ERROR: Line " << r + first + bad + 4
+                          << " of GCT file is malformed " + filename
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            store(r + first, n_lines, values.data(), batch_rows);
+        }
+        r += offsets.size() - 1;
+    }
+
+    if (r < rows) {
+        std::cerr << "ERROR: GCT file has " << r << " rows but line 2 says "
+                  << rows << " " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Bytes of parsed values to buffer at a time when reading into memory.
+static const ulong GCT_BATCH_BYTES = 1 << 26;
+
+void read_gct(
+    const std::string & filename,
+    const ColumnSelection & columns,
+    std::vector<std::string> & row_names,
+    std::vector<std::string> & col_names,
+    MatrixXd & data,
+    VectorXd & row_norms
+)
+{
+    LineReader lines;
+    ulong rows;
+    std::vector<std::string> all_col_names;
+    std::vector<long> slots;
+    read_gct_header(filename, lines, rows, all_col_names);
+    select_slots(all_col_names, columns, col_names, slots);
+    row_names.resize(rows);
+    data.resize(rows, col_names.size());
+    read_gct_rows(
+        filename, lines, slots, col_names.size(), GCT_BATCH_BYTES,
+        row_names, row_norms,
+        [&] (ulong row, ulong n, const double * values, ulong stride) {
+            data.middleRows(row, n) =
+                Map<const MatrixXd, 0, OuterStride<> >(
+                    values, n, data.cols(), OuterStride<>(stride)
+                );
+        }
+    );
+}
+
+void read_gct(
+    const std::string & filename,
+    const ColumnSelection & columns,
+    ulong max_bytes,
+    std::vector<std::string> & row_names,
+    std::vector<std::string> & col_names,
+    MappedMatrix & data,
+    VectorXd & row_norms
+)
+{
+    LineReader lines;
+    ulong rows;
+    std::vector<std::string> all_col_names;
+    std::vector<long> slots;
+    read_gct_header(filename, lines, rows, all_col_names);
+    select_slots(all_col_names, columns, col_names, slots);
+    row_names.resize(rows);
+    // Copy each batch into the columns of the map, and let the kernel write
+    // them back to the file.
+    read_gct_rows(
+        filename, lines, slots, col_names.size(), max_bytes,
+        row_names, row_norms,
+        [&] (ulong row, ulong n, const double * values, ulong stride) {
+            for (ulong j = 0; j < data.cols(); j++) {
+                memcpy(data.col(j) + row, values + j * stride,
+                       n * sizeof(double));
+            }
+            data.release();
+        }
+    );
+}
+
+void select_columns(
+    const std::vector<bool> & keep,
+    std::vector<std::string> & col_names,
+    MatrixXd & data
+)
+{
+    long n_kept = 0;
+    for (long i = 0; i < data.cols(); i++) {
+        if (keep[i]) {
+            if (n_kept < i) {
+                data.col(n_kept) = data.col(i);
+                col_names[n_kept] = col_names[i];
+            }
+            n_kept++;
+        }
+    }
+    data.conservativeResize(Eigen::NoChange, n_kept);
+    col_names.resize(n_kept);
+}
+
+void select_columns(
+    const std::vector<bool> & keep,
+    std::vector<std::string> & col_names,
+    MappedMatrix & data,
+    const std::string & folder
+)
+{
+    ulong n_kept = std::count(keep.begin(), keep.end(), true);
+    MappedMatrix kept;
+    kept.create(folder, data.rows(), n_kept);
+    n_kept = 0;
+    for (ulong i = 0; i < data.cols(); i++) {
+        if (keep[i]) {
+            memcpy(kept.col(n_kept), data.col(i), sizeof(double) * data.rows());
+            kept.release(n_kept, 1);
+            col_names[n_kept] = col_names[i];
+            n_kept++;
+        }
+        data.release(i, 1);
+    }
+    col_names.resize(n_kept);
+    data.swap(kept);
+}
+
+// Buffers reused by each thread to rank one column after another.
+struct RankScratch
+{
+    std::vector<uint64_t> keys, keys2;
+    std::vector<uint32_t> order, order2;
+};
+
+// Map a double to an integer that sorts in the opposite order, so the
+// largest value comes first. -0.0 is the same as 0.0, and NaN comes last.
+static inline uint64_t descending_key(double x)
+{
+    if (x != x) {
+        return ~0ULL;
+    }
+    if (x == 0) {
+        x = 0;
+    }
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    // Flip negative numbers, and set the sign bit of positive numbers, so
+    // the integers sort like the doubles. Then reverse the order.
+    bits = (bits >> 63) ? ~bits : bits | (1ULL << 63);
+    return ~bits;
+}
+
+// Replace x[0..n) with the ranks of its values, where rank 1 is the largest
+// value and ties get the mean of their ranks, like R's rank() with
+// ties.method="average". Sort with a radix sort on the keys from
+// descending_key(), one byte at a time.
+static void rank_in_place(double * x, ulong n, RankScratch & scratch)
+{
+    std::vector<uint64_t> & keys = scratch.keys, & keys2 = scratch.keys2;
+    std::vector<uint32_t> & order = scratch.order, & order2 = scratch.order2;
+    if (n == 0) {
+        return;
+    }
+    keys.resize(n);
+    keys2.resize(n);
+    order.resize(n);
+    order2.resize(n);
+    for (ulong i = 0; i < n; i++) {
+        keys[i] = descending_key(x[i]);
+        order[i] = i;
+    }
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        ulong counts[257] = {0};
+        for (ulong i = 0; i < n; i++) {
+            counts[((keys[i] >> shift) & 0xff) + 1]++;
+        }
+        // Skip the pass if every key has the same byte here.
+        if (counts[((keys[0] >> shift) & 0xff) + 1] == n) {
+            continue;
+        }
+        for (int b = 0; b < 256; b++) {
+            counts[b + 1] += counts[b];
+        }
+        for (ulong i = 0; i < n; i++) {
+            ulong j = counts[(keys[i] >> shift) & 0xff]++;
+            keys2[j] = keys[i];
+            order2[j] = order[i];
+        }
+        keys.swap(keys2);
+        order.swap(order2);
+    }
+
+    for (ulong i = 0, reps; i < n; i += reps) {
+        reps = 1;
+        while (i + reps < n && keys[i] == keys[i + reps]) {
+            ++reps;
+        }
+        double rank = (2.0 * i + reps - 1.0) / 2.0 + 1.0;
+        for (ulong j = 0; j < reps; j++) {
+            x[order[i + j]] = rank;
+        }
+    }
+}
+
+void rank_columns(MatrixXd & data, const VectorXd & row_norms)
+{
+    #pragma omp parallel
+    {
+        RankScratch scratch;
+        #pragma omp for schedule(dynamic)
+        for (long i = 0; i < data.cols(); i++) {
+            data.col(i) = data.col(i).array() / row_norms.array();
+            rank_in_place(data.col(i).data(), data.rows(), scratch);
+        }
+    }
+}
+
+void rank_columns(MappedMatrix & data, const VectorXd & row_norms)
+{
+    #pragma omp parallel
+    {
+        RankScratch scratch;
+        #pragma omp for schedule(dynamic)
+        for (ulong i = 0; i < data.cols(); i++) {
+            Map<VectorXd> col(data.col(i), data.rows());
+            col = col.array() / row_norms.array();
+            rank_in_place(col.data(), data.rows(), scratch);
+            data.release(i, 1);
+        }
+    }
+}
+
+bool PackedMatrix::is_packed(const std::string & filename)
+{
+    std::ifstream stream(filename.c_str(), std::ios::binary);
+    char magic[sizeof(PACKED_MATRIX_MAGIC)];
+    return stream.read(magic, sizeof(magic))
+           && memcmp(magic, PACKED_MATRIX_MAGIC, sizeof(magic)) == 0;
+}
+
+void PackedMatrix::write(
+    const std::string & filename,
+    const std::vector<std::string> & row_names,
+    const std::vector<std::string> & col_names,
+    const MatrixXd & data,
+    Kind kind
+)
+{
+    std::string names;
+    for (const auto & name : row_names) {
+        names += name + '\0';
+    }
+    for (const auto & name : col_names) {
+        names += name + '\0';
+    }
+
+    packed_matrix_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACKED_MATRIX_MAGIC, sizeof(header.magic));
+    header.version = PACKED_MATRIX_VERSION;
+    header.kind = kind;
+    header.rows = data.rows();
+    header.cols = data.cols();
+    header.names_size = names.size();
+    uint64_t end = sizeof(header) + names.size();
+    header.data_offset = (end + PACKED_MATRIX_ALIGN - 1)
+                         / PACKED_MATRIX_ALIGN * PACKED_MATRIX_ALIGN;
+
+    std::ofstream stream(filename.c_str(), std::ios::binary);
+    stream.write((const char *) &header, sizeof(header));
+    stream.write(names.data(), names.size());
+    std::string padding(header.data_offset - end, '\0');
+    stream.write(padding.data(), padding.size());
+    stream.write(
+        (const char *) data.data(), sizeof(double) * data.rows() * data.cols()
+    );
+    if (!stream) {
+        std::cerr << "ERROR: Cannot write " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool PackedMatrix::open(const std::string & filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0
+        || (size_t) st.st_size < sizeof(packed_matrix_header)) {
+        ::close(fd);
+        return false;
+    }
+    void * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    _map = map;
+    _map_size = st.st_size;
+
+    const packed_matrix_header * header = (const packed_matrix_header *) _map;
+    const char * names = (const char *) _map + sizeof(*header);
+    if (memcmp(header->magic, PACKED_MATRIX_MAGIC, sizeof(header->magic)) != 0
+        || header->version != PACKED_MATRIX_VERSION
+        || header->kind > RANKS
+        || header->data_offset % PACKED_MATRIX_ALIGN != 0
+        || header->data_offset < sizeof(*header) + header->names_size
+        || _map_size != header->data_offset
+                        + sizeof(double) * header->rows * header->cols
+        || (header->names_size > 0 && names[header->names_size - 1] != '\0')) {
+        close();
+        return false;
+    }
+
+    // Split the table of names.
+    const char * p = names;
+    const char * names_end = names + header->names_size;
+    for (uint64_t i = 0; i < header->rows + header->cols; i++) {
+        if (p >= names_end) {
+            close();
+            return false;
+        }
+        size_t n = strlen(p);
+        (i < header->rows ? _row_names : _col_names).push_back(
+            std::string(p, n)
+        );
+        p += n + 1;
+    }
+
+    _rows = header->rows;
+    _cols = header->cols;
+    _kind = (Kind) header->kind;
+    _data = (const double *) ((const char *) _map + header->data_offset);
+    madvise(_map, _map_size, MADV_SEQUENTIAL);
+    return true;
+}
+
+void PackedMatrix::close()
+{
+    if (_map != NULL) {
+        munmap(_map, _map_size);
+    }
+    _map = NULL;
+    _map_size = 0;
+    _data = NULL;
+    _rows = _cols = 0;
+    _kind = RAW;
+    _row_names.clear();
+    _col_names.clear();
+}
+
+void MappedMatrix::create(const std::string & folder, ulong rows, ulong cols)
+{
+    close();
+    std::string filename = folder + "/matrix.XXXXXX";
+    std::vector<char> name(filename.begin(), filename.end());
+    name.push_back('\0');
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+        std::cerr << "ERROR: Cannot write " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    unlink(&name[0]);
+    size_t size = sizeof(double) * rows * cols;
+    void * map = MAP_FAILED;
+    if (size > 0 && ftruncate(fd, size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "ERROR: Cannot map " << size << " bytes in "
+                  << folder << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    _map = map;
+    _map_size = size;
+    _data = (double *) _map;
+    _rows = rows;
+    _cols = cols;
+}
+
+bool MappedMatrix::open(
+    const std::string & filename,
+    size_t offset,
+    ulong rows,
+    ulong cols
+)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    size_t size = offset + sizeof(double) * rows * cols;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < size || size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void * map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    _map = map;
+    _map_size = size;
+    _data = (double *) ((char *) _map + offset);
+    _rows = rows;
+    _cols = cols;
+    return true;
+}
+
+void MappedMatrix::close()
+{
+    if (_map != NULL) {
+        munmap(_map, _map_size);
+    }
+    _map = NULL;
+    _map_size = 0;
+    _data = NULL;
+    _rows = _cols = 0;
+}
+
+void MappedMatrix::swap(MappedMatrix & other)
+{
+    std::swap(_map, other._map);
+    std::swap(_map_size, other._map_size);
+    std::swap(_data, other._data);
+    std::swap(_rows, other._rows);
+    std::swap(_cols, other._cols);
+}
+
+void MappedMatrix::release(ulong first, ulong n)
+{
+    if (_map == NULL || n == 0) {
+        return;
+    }
+    // Round out to whole pages.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = (char *) col(first) - (char *) _map;
+    size_t end = (char *) col(first + n) - (char *) _map;
+    begin = begin / page * page;
+    end = std::min(_map_size, (end + page - 1) / page * page);
+    madvise((char *) _map + begin, end - begin, MADV_DONTNEED);
+}
@@ -0,0 +1,264 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+#ifndef _MATRIX_H
+#define _MATRIX_H
+
+#include <memory>
+#include <regex.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// The columns of a gene matrix chosen with --columns: either the names
+// listed in a file, or the names that match a POSIX extended regular
+// expression. An empty selection keeps every column.
+class ColumnSelection
+{
+public:
+    ColumnSelection() {}
+
+    // Read names from a file if it exists, otherwise compile a regular
+    // expression. An empty string keeps every column. Exit if the
+    // expression is invalid. Errors name the option flag.
+    explicit ColumnSelection(
+        const std::string & arg,
+        const std::string & flag = "--columns"
+    );
+
+    // Return true if every column is kept.
+    bool all() const
+    {
+        return !_regex && _names.empty();
+    }
+
+    // Return a flag for each column that is kept. Exit if a listed name is
+    // absent or if no column is kept.
+    std::vector<bool> select(const std::vector<std::string> & col_names) const;
+
+private:
+    std::set<std::string> _names;
+    std::string _pattern, _flag;
+    std::shared_ptr<regex_t> _regex;
+};
+
+// A column-major matrix of doubles in a file mapped into memory, used when
+// the gene matrix does not fit in --max-memory. The kernel reads and writes
+// back pages as we touch them. release() advises it that we are done with
+// some pages, but the kernel decides when to drop them, so nothing here
+// bounds the memory we use.
+class MappedMatrix
+{
+public:
+    MappedMatrix() : _map(NULL), _map_size(0), _data(NULL), _rows(0),
+                     _cols(0) {}
+    ~MappedMatrix() { close(); }
+
+    // A copy would unmap the same pages twice. Use swap() instead.
+    MappedMatrix(const MappedMatrix &) = delete;
+    MappedMatrix & operator=(const MappedMatrix &) = delete;
+
+    // Create a file for a matrix in a folder and map it. The file is
+    // removed at once, so it is gone when the map is closed. Exit if it
+    // cannot be created.
+    void create(const std::string & folder, ulong rows, ulong cols);
+
+    // Map a matrix stored at an offset in an existing file, read-only.
+    // Return false if the file is too small.
+    bool open(
+        const std::string & filename,
+        size_t offset,
+        ulong rows,
+        ulong cols
+    );
+
+    void close();
+
+    // Exchange the maps of two matrices.
+    void swap(MappedMatrix & other);
+
+    bool is_open() const
+    {
+        return _map != NULL;
+    }
+
+    ulong rows() const
+    {
+        return _rows;
+    }
+
+    ulong cols() const
+    {
+        return _cols;
+    }
+
+    double * data()
+    {
+        return _data;
+    }
+
+    double * col(ulong j)
+    {
+        return _data + j * _rows;
+    }
+
+    // Advise the kernel that it may drop the pages of columns
+    // [first, first + n) from memory. They are read back from the file if
+    // we touch them again.
+    void release(ulong first, ulong n);
+
+    void release()
+    {
+        release(0, _cols);
+    }
+
+private:
+    void * _map;
+    size_t _map_size;
+    double * _data;
+    ulong _rows, _cols;
+};
+
+// Read the number of rows of a GCT file or a file written by snpsea-pack,
+// and count the columns kept by the selection, without reading the values.
+void read_matrix_size(
+    const std::string & filename,
+    const ColumnSelection & columns,
+    ulong & rows,
+    ulong & cols
+);
+
+// Read an optionally gzipped GCT file into a matrix with one row for each
+// gene and one column for each selected condition. Compute the norm of each
+// row over all columns, including the ones we skip. Exit if the file is
+// malformed.
+void read_gct(
+    const std::string & filename,
+    const ColumnSelection & columns,
+    std::vector<std::string> & row_names,
+    std::vector<std::string> & col_names,
+    MatrixXd & data,
+    VectorXd & row_norms
+);
+
+// Same as above, but write the values to a mapped matrix that already has
+// the size given by read_matrix_size(), buffering at most max_bytes of them.
+void read_gct(
+    const std::string & filename,
+    const ColumnSelection & columns,
+    ulong max_bytes,
+    std::vector<std::string> & row_names,
+    std::vector<std::string> & col_names,
+    MappedMatrix & data,
+    VectorXd & row_norms
+);
+
+// Keep the flagged columns of a matrix and their names.
+void select_columns(
+    const std::vector<bool> & keep,
+    std::vector<std::string> & col_names,
+    MatrixXd & data
+);
+
+// Same as above, but copy the flagged columns of a mapped matrix to a new
+// file in a folder.
+void select_columns(
+    const std::vector<bool> & keep,
+    std::vector<std::string> & col_names,
+    MappedMatrix & data,
+    const std::string & folder
+);
+
+// Divide each row by its norm, then replace each column with the ranks of
+// its values, where rank 1 is the largest value. Divide by the number of
+// genes to get the reverse percentile ranks used for scoring. The norms are
+// those of the whole rows, when data holds only some of the columns. The
+// columns are ranked in parallel.
+void rank_columns(MatrixXd & data, const VectorXd & row_norms);
+
+// Same as above, one column at a time, releasing each column when done.
+void rank_columns(MappedMatrix & data, const VectorXd & row_norms);
+
+// A gene matrix in the binary format written by snpsea-pack.
+//
+// The file has a 64-byte header, a table of row names and then column
+// names (each ending with '\0'), and the values in column-major order as
+// doubles. The values start at a multiple of 64 bytes, so the mapped file
+// can be used without copying or parsing. They are either the raw values
+// from a GCT file or the ranks from rank_columns().
+class PackedMatrix
+{
+public:
+    enum Kind {
+        RAW = 0,
+        RANKS = 1
+    };
+
+    PackedMatrix() : _map(NULL), _map_size(0), _data(NULL), _rows(0),
+                     _cols(0), _kind(RAW) {}
+    ~PackedMatrix() { close(); }
+
+    // A copy would unmap the same pages twice.
+    PackedMatrix(const PackedMatrix &) = delete;
+    PackedMatrix & operator=(const PackedMatrix &) = delete;
+
+    // Return true if the file starts with the magic bytes of this format.
+    static bool is_packed(const std::string & filename);
+
+    // Write a matrix to a file. Exit if the file cannot be written.
+    static void write(
+        const std::string & filename,
+        const std::vector<std::string> & row_names,
+        const std::vector<std::string> & col_names,
+        const MatrixXd & data,
+        Kind kind
+    );
+
+    // Map a file into memory. Return false if it is not valid.
+    bool open(const std::string & filename);
+
+    void close();
+
+    ulong rows() const
+    {
+        return _rows;
+    }
+
+    ulong cols() const
+    {
+        return _cols;
+    }
+
+    Kind kind() const
+    {
+        return _kind;
+    }
+
+    const std::vector<std::string> & row_names() const
+    {
+        return _row_names;
+    }
+
+    const std::vector<std::string> & col_names() const
+    {
+        return _col_names;
+    }
+
+    // The values in column-major order, valid until close().
+    const double * data() const
+    {
+        return _data;
+    }
+
+private:
+    void * _map;
+    size_t _map_size;
+    const double * _data;
+    ulong _rows, _cols;
+    Kind _kind;
+    std::vector<std::string> _row_names, _col_names;
+};
+
+#endif
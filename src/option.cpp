@@ -79,48 +79,54 @@ int main(int argc, const char * argv[])
         0, // Delimiter if expecting multiple args.
         "Text file with SNP identifiers in the first column."
         " Instead of a file name, you may use 'randomN' with an integer N for"
-        " a random SNP list of length N.",
+        " a random SNP list of length N. A file whose lines name SNP files"
+        " is a list of traits, which are each tested in a folder in --out.",
         "--snps" // Flag token.
     );
 
     opt.add(
         "", // Default.
-        1, // Required?
+        0, // Required?
         1, // Number of args expected.
         0, // Delimiter if expecting multiple args.
-        "Gene matrix file in GCT format. The Name column must contain the"
-        " same gene identifiers as in --gene-intervals.",
+        "Gene matrix file in GCT format, or converted with snpsea-pack."
+        " The Name column must contain the same gene identifiers as in"
+        " --gene-intervals. Not needed with --load-state.",
         "--gene-matrix" // Flag token.
     );
 
     opt.add(
         "", // Default.
-        1, // Required?
+        0, // Required?
         1, // Number of args expected.
         0, // Delimiter if expecting multiple args.
         "BED file with gene intervals. The fourth column must contain the"
-        " same gene identifiers as in --gene-matrix.",
+        " same gene identifiers as in --gene-matrix. Not needed with"
+        " --load-state.",
         "--gene-intervals" // Flag token.
     );
 
     opt.add(
         "", // Default.
         1, // Required?
-        1, // Number of args expected.
-        0, // Delimiter if expecting multiple args.
+        -1, // Number of args expected.
+        ',', // Delimiter if expecting multiple args.
         "BED file with all known SNP intervals. The fourth column must"
-        " contain the same SNP identifiers as in --snps and --null-snps.",
+        " contain the same SNP identifiers as in --snps and --null-snps."
+        " If the file was prepared with snpsea-index, only the lines for"
+        " those SNPs are read. Pass a comma-separated list of files to test"
+        " each one, see --slop.",
         "--snp-intervals" // Flag token.
     );
 
     opt.add(
         "", // Default.
-        1, // Required?
+        0, // Required?
         1, // Number of args expected.
         0, // Delimiter if expecting multiple args.
         "Text file with SNP identifiers to sample when generating null"
         " matched or random SNP sets. These SNPs must be a subset of"
-        " --snp-intervals.",
+        " --snp-intervals. Not needed with --load-state.",
         "--null-snps" // Flag token.
     );
 
@@ -144,14 +150,85 @@ int main(int argc, const char * argv[])
         "--condition" // Flag token.
     );
 
-    ezOptionValidator * vU8 = new ezOptionValidator(ezOptionValidator::U8);
     opt.add(
-        "10000", // Default.
+        "", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Text file with a list of columns in --gene-matrix to test, or a"
+        " POSIX extended regular expression that matches their names. Each"
+        " row is still normalized over all of the columns.",
+        "--columns" // Flag token.
+    );
+
+    opt.add(
+        "", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Condition on each of these columns in --gene-matrix in turn, and"
+        " write a matrix of p-values. Give a text file with a list of"
+        " columns, or a POSIX extended regular expression. Use '.' for all"
+        " of the columns.",
+        "--condition-each" // Flag token.
+    );
+
+    opt.add(
+        "", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Folder to cache the genes near each SNP in --null-snps. Runs that"
+        " share --snp-intervals, --gene-intervals and --slop reuse the cache"
+        " instead of searching for the genes again.",
+        "--locus-cache" // Flag token.
+    );
+
+    opt.add(
+        "", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Save the ranked gene matrix, gene intervals and null SNP gene sets"
+        " to this file, so later runs can skip reading and preparing them.",
+        "--save-state" // Flag token.
+    );
+
+    opt.add(
+        "", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Load a file written with --save-state instead of reading"
+        " --gene-matrix, --gene-intervals and --null-snps. The --slop saved"
+        " in the file is used. Only the intervals for --snps are read from"
+        " --snp-intervals.",
+        "--load-state" // Flag token.
+    );
+
+    opt.add(
+        "0", // Default.
         0, // Required?
         1, // Number of args expected.
         0, // Delimiter if expecting multiple args.
+        "If the gene matrix needs more than this many megabytes, keep it in"
+        " a file in --out that is mapped into memory instead of allocating"
+        " it. This is a threshold, not an enforced limit. Cannot be used with"
+        " --condition or --condition-each.\n[default: 0, no limit]",
+        "--max-memory" // Flag token.
+    );
+
+    ezOptionValidator * vU8 = new ezOptionValidator(ezOptionValidator::U8);
+    opt.add(
+        "10000", // Default.
+        0, // Required?
+        -1, // Number of args expected.
+        ',', // Delimiter if expecting multiple args.
         "If a SNP overlaps no gene intervals, extend the SNP interval this"
-        " many nucleotides further and try again.\n[default: 10000]",
+        " many nucleotides further and try again. Pass a comma-separated"
+        " list of values to test each one. Each combination of"
+        " --snp-intervals and --slop is tested in a folder in --out, and the"
+        " gene matrix is read once.\n[default: 10000]",
         "--slop", // Flag token.
         vU8
     );
@@ -159,10 +236,12 @@ int main(int argc, const char * argv[])
     opt.add(
         "single", // Default.
         0, // Required?
-        1, // Number of args expected.
-        0, // Delimiter if expecting multiple args.
+        -1, // Number of args expected.
+        ',', // Delimiter if expecting multiple args.
         "Score each SNP locus with its 'single' most specific gene"
-        " or the 'total' of all genes in the locus.\n[default: single]",
+        " or the 'total' of all genes in the locus. Pass 'single,total' to"
+        " test both with the same null SNP sets and write separate p-value"
+        " files.\n[default: single]",
         "--score" // Flag token.
     );
 
@@ -189,6 +268,17 @@ int main(int argc, const char * argv[])
         ge0
     );
 
+    opt.add(
+        "", // Default.
+        0, // Required?
+        0, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Do not write the p-value of each column for each null SNP set to"
+        " null_pvalues.txt. The proportions of them below a few thresholds"
+        " are still written to type1error.txt.",
+        "--no-null-pvalues" // Flag token.
+    );
+
     opt.add(
         "25", // Default.
         0, // Required?
@@ -264,20 +354,30 @@ int main(int argc, const char * argv[])
     user_snpset_file,
     gene_matrix_file,
     gene_intervals_file,
-    snp_intervals_file,
     null_snps_file,
     condition_file,
-    out_folder,
-    score_method;
+    condition_each,
+    column_selection,
+    locus_cache_folder,
+    save_state_file,
+    load_state_file,
+    out_folder;
+
+    std::vector<std::string> snp_intervals_files, score_methods;
 
     opt.get("--snps")->getString(user_snpset_file);
     opt.get("--gene-matrix")->getString(gene_matrix_file);
     opt.get("--gene-intervals")->getString(gene_intervals_file);
-    opt.get("--snp-intervals")->getString(snp_intervals_file);
+    opt.get("--snp-intervals")->getStrings(snp_intervals_files);
     opt.get("--null-snps")->getString(null_snps_file);
     opt.get("--condition")->getString(condition_file);
+    opt.get("--condition-each")->getString(condition_each);
+    opt.get("--columns")->getString(column_selection);
+    opt.get("--locus-cache")->getString(locus_cache_folder);
+    opt.get("--save-state")->getString(save_state_file);
+    opt.get("--load-state")->getString(load_state_file);
     opt.get("--out")->getString(out_folder);
-    opt.get("--score")->getString(score_method);
+    opt.get("--score")->getStrings(score_methods);
 
     // Ensure the files exist.
     // The argument may be a filename or a string like "random20".
@@ -294,10 +394,47 @@ int main(int argc, const char * argv[])
         // Otherwise, ensure the file exists.
         assert_file_exists(user_snpset_file);
     }
-    assert_file_exists(gene_matrix_file);
-    assert_file_exists(gene_intervals_file);
-    assert_file_exists(snp_intervals_file);
-    assert_file_exists(null_snps_file);
+    for (const auto & file : snp_intervals_files) {
+        assert_file_exists(file);
+    }
+    if (std::set<std::string>(
+            snp_intervals_files.begin(), snp_intervals_files.end()
+        ).size() < snp_intervals_files.size()) {
+        std::cerr << "ERROR: --snp-intervals lists a file more than once"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (load_state_file.length() > 0) {
+        // The state replaces these inputs.
+        assert_file_exists(load_state_file);
+        if (condition_file.length() > 0) {
+            std::cerr << "ERROR: --condition cannot be used with"
+                      << " --load-state. Pass it when saving the state."
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (condition_each.length() > 0) {
+            std::cerr << "ERROR: --condition-each cannot be used with"
+                      << " --load-state, because the state holds ranks"
+                      << " instead of values." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        const char * required[] = {
+            "--gene-matrix", "--gene-intervals", "--null-snps"
+        };
+        for (auto flag : required) {
+            if (!opt.isSet(flag)) {
+                Usage(opt);
+                std::cerr << "ERROR: Missing required option "
+                          << flag << ".\n";
+                return 1;
+            }
+        }
+        assert_file_exists(gene_matrix_file);
+        assert_file_exists(gene_intervals_file);
+        assert_file_exists(null_snps_file);
+    }
     // Optional.
     if (condition_file.length() > 0) {
         assert_file_exists(condition_file);
@@ -305,21 +442,32 @@ int main(int argc, const char * argv[])
 
     // Create the output directory.
     mkpath(out_folder);
+    if (locus_cache_folder.length() > 0) {
+        mkpath(locus_cache_folder);
+    }
 
     // Restrict the score methods.
-    if (score_method[0] == 's') {
-        score_method = "single";
-    } else if (score_method[0] == 't') {
-        score_method = "total";
-    } else {
-        std::cerr << "ERROR: --score" << score_method << std::endl;
-        std::cerr << "Must be one of: single total" << std::endl;
+    for (auto & score_method : score_methods) {
+        if (score_method[0] == 's') {
+            score_method = "single";
+        } else if (score_method[0] == 't') {
+            score_method = "total";
+        } else {
+            std::cerr << "ERROR: --score " << score_method << std::endl;
+            std::cerr << "Must be one of: single total" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (std::set<std::string>(
+            score_methods.begin(), score_methods.end()
+        ).size() < score_methods.size()) {
+        std::cerr << "ERROR: --score lists a method more than once"
+                  << std::endl;
         exit(EXIT_FAILURE);
     }
 
     int
-    threads,
-    slop;
+    threads;
 
     long
     null_snpset_replicates,
@@ -331,17 +479,52 @@ int main(int argc, const char * argv[])
     opt.get("--min-observations")->getLong(min_observations);
 
     double
-    slop_d,
-    max_iterations_d;
+    max_iterations_d,
+    max_memory_d;
+
+    std::vector<double> slops_d;
 
     // Read double so we can pass things like "1e6" and "250e3".
-    opt.get("--slop")->getDouble(slop_d);
+    opt.get("--slop")->getDoubles(slops_d);
     opt.get("--max-iterations")->getDouble(max_iterations_d);
+    opt.get("--max-memory")->getDouble(max_memory_d);
 
     // Convert to proper types.
-    slop = slop_d;
     max_iterations = max_iterations_d;
 
+    std::vector<ulong> slops;
+    for (auto slop_d : slops_d) {
+        if (slop_d < 0) {
+            std::cerr << "ERROR: Invalid option: --slop " << slop_d
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        slops.push_back(slop_d);
+    }
+    if (std::set<ulong>(slops.begin(), slops.end()).size() < slops.size()) {
+        std::cerr << "ERROR: --slop lists a value more than once"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // The state holds the genes near the null SNPs for one SNP interval
+    // file and slop.
+    if (snp_intervals_files.size() * slops.size() > 1
+        && (save_state_file.length() > 0 || load_state_file.length() > 0)) {
+        std::cerr << "ERROR: --save-state and --load-state cannot be used"
+                  << " with more than one --snp-intervals file or --slop"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (max_memory_d < 0) {
+        std::cerr << "ERROR: Invalid option: --max-memory "
+                  << max_memory_d << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    // Megabytes to bytes.
+    ulong max_memory = max_memory_d * 1024 * 1024;
+
     if (max_iterations <= 0) {
         std::cerr << "ERROR: Invalid option: --max-iterations "
                   << max_iterations << std::endl
@@ -364,16 +547,23 @@ int main(int argc, const char * argv[])
         user_snpset_file,
         gene_matrix_file,
         gene_intervals_file,
-        snp_intervals_file,
+        snp_intervals_files,
         null_snps_file,
         condition_file,
+        condition_each,
+        column_selection,
+        locus_cache_folder,
+        save_state_file,
+        load_state_file,
         out_folder,
-        score_method,
-        slop,
+        score_methods,
+        slops,
         threads,
         null_snpset_replicates,
+        !opt.isSet("--no-null-pvalues"),
         min_observations,
-        max_iterations
+        max_iterations,
+        max_memory
     );
 
     return 0;
@@ -0,0 +1,63 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+// snpsea-pack: convert a GCT gene matrix to a binary file that SNPsea can
+// map into memory instead of parsing the text on every run.
+
+#include "matrix.h"
+#include "snpsea.h"
+
+static void usage()
+{
+    std::cout <<
+        "Usage:\n"
+        "    snpsea-pack [--ranks] in.gct.gz out.bin\n\n"
+        "Convert a (optionally gzipped) GCT file to the binary format read\n"
+        "by SNPsea. Pass out.bin to snpsea with --gene-matrix.\n\n"
+        "With --ranks, normalize and rank each column ahead of time, so\n"
+        "SNPsea can skip that step too. A matrix packed with --ranks cannot\n"
+        "be used with --condition. Binary matrices are always stored as is.\n"
+        "\n"
+        "SNPsea " SNPSEA_VERSION "\n";
+}
+
+int main(int argc, const char * argv[])
+{
+    bool ranks = argc == 4 && std::string(argv[1]) == "--ranks";
+    if (argc != 3 + ranks || argv[1 + ranks][0] == '-') {
+        usage();
+        return 1;
+    }
+
+    std::string in_file = argv[1 + ranks];
+    std::string out_file = argv[2 + ranks];
+    assert_file_exists(in_file);
+
+    gzifstream::default_inflate_threads = cpu_count();
+
+    std::vector<std::string> row_names, col_names;
+    MatrixXd data;
+    VectorXd row_norms;
+    read_gct(
+        in_file, ColumnSelection(), row_names, col_names, data, row_norms
+    );
+
+    PackedMatrix::Kind kind = PackedMatrix::RAW;
+    if (ranks) {
+        if (is_binary(data.col(0))) {
+            std::cout << "The matrix is binary, so it is stored as is."
+                      << std::endl;
+        } else {
+            rank_columns(data, row_norms);
+            kind = PackedMatrix::RANKS;
+        }
+    }
+
+    PackedMatrix::write(out_file, row_names, col_names, data, kind);
+
+    std::cout << "Packed " << data.rows() << " rows and " << data.cols()
+              << " columns of "
+              << (kind == PackedMatrix::RANKS ? "ranks" : "values")
+              << " into " + out_file + "." << std::endl;
+    return 0;
+}
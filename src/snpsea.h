@@ -9,6 +9,10 @@
 #include <Eigen/Dense>
 #include "IntervalTree.h"
 #include "common.h"
+#include "intervals.h"
+#include "bgzf.h"
+#include "lines.h"
+#include "matrix.h"
 
 using namespace Eigen;
 
@@ -19,32 +23,46 @@ public:
         std::string user_snpset_file,
         std::string gene_matrix_file,
         std::string gene_intervals_file,
-        std::string snp_intervals_file,
+        std::vector<std::string> snp_intervals_files,
         std::string null_snps_file,
         std::string condition_file,
+        std::string condition_each,
+        std::string column_selection,
+        std::string locus_cache_folder,
+        std::string save_state_file,
+        std::string load_state_file,
         std::string out_folder,
-        std::string score_method,
-        ulong slop,
+        std::vector<std::string> score_methods,
+        std::vector<ulong> slops,
         int threads,
         ulong null_snpset_replicates,
+        bool write_null_pvalues,
         ulong min_observations,
-        ulong max_iterations
+        ulong max_iterations,
+        ulong max_memory
     );
 
     void write_args(
         std::string user_snpset_file,
         std::string gene_matrix_file,
         std::string gene_intervals_file,
-        std::string snp_intervals_file,
+        std::vector<std::string> snp_intervals_files,
         std::string null_snps_file,
         std::string condition_file,
+        std::string condition_each,
+        std::string column_selection,
+        std::string locus_cache_folder,
+        std::string save_state_file,
+        std::string load_state_file,
         std::string out_folder,
-        std::string score_method,
-        ulong slop,
+        std::vector<std::string> score_methods,
+        std::vector<ulong> slops,
         int threads,
         ulong null_snpset_replicates,
+        bool write_null_pvalues,
         ulong min_observations,
         ulong max_iterations,
+        ulong max_memory,
         std::ostream & stream
     );
 
@@ -53,24 +71,87 @@ public:
         std::set<std::string> & names
     );
 
-    std::vector<ulong> snp_geneset(std::string, ulong slop);
+    bool read_manifest(
+        std::string filename,
+        std::vector<std::string> & files,
+        std::vector<std::string> & names
+    );
+
+    void test_trait(
+        std::string user_snpset_file,
+        std::string out_folder,
+        std::vector<std::string> score_methods,
+        const ColumnSelection & columns,
+        bool conditioning_each,
+        int threads,
+        ulong null_snpset_replicates,
+        bool write_null_pvalues,
+        ulong min_observations,
+        ulong max_iterations,
+        std::vector<std::vector<ulong> > & genesets,
+        std::vector<ulong> & bin_counts
+    );
+
+    std::vector<ulong> snp_geneset(std::string);
+
+    void find_snp_genesets(
+        std::string snp_intervals_file,
+        std::string gene_intervals_file,
+        std::string cache_folder,
+        ulong slop
+    );
+
+    void store_snp_genesets(
+        std::vector<std::vector<ulong> > & genesets,
+        const std::vector<bool> & found,
+        ulong slop
+    );
+
+    void save_state(const std::string & filename, ulong slop);
+
+    ulong load_state(
+        const std::string & filename,
+        const std::string & snp_intervals_file,
+        ulong max_memory
+    );
 
     void random_snps(
         std::string filename,
-        std::set<std::string> & names,
-        ulong slop
+        std::set<std::string> & names
     );
 
     void read_bed_intervals(
         std::string filename,
-        std::unordered_map<std::string, genomic_interval> & intervals
+        const std::unordered_set<std::string> & names,
+        SNPIntervalStore & intervals
+    );
+
+    void read_bed_intervals_indexed(
+        std::string filename,
+        const BEDIndex & index,
+        const std::unordered_set<std::string> & names,
+        SNPIntervalStore & intervals
     );
 
     void read_gct(
         std::string filename,
+        const ColumnSelection & columns,
         std::vector<std::string> & row_names,
         std::vector<std::string> & col_names,
-        MatrixXd & data
+        MatrixXd & data,
+        MappedMatrix & store,
+        ulong max_bytes,
+        VectorXd & row_norms
+    );
+
+    bool read_packed_matrix(
+        std::string filename,
+        const ColumnSelection & columns,
+        std::vector<std::string> & row_names,
+        std::vector<std::string> & col_names,
+        MatrixXd & data,
+        MappedMatrix & store,
+        VectorXd & row_norms
     );
 
     void read_bed_interval_tree(
@@ -84,8 +165,7 @@ public:
         std::set<std::string> & snp_names,
         std::set<std::string> & absent_snp_names,
         std::unordered_map<std::string, std::vector<ulong> > & genesets,
-        std::vector<ulong> & geneset_sizes,
-        ulong slop
+        std::vector<ulong> & geneset_sizes
     );
 
     void merge_user_snps(
@@ -96,8 +176,6 @@ public:
 
     void report_user_snp_genes(const std::string & filename);
 
-    void drop_snp_intervals();
-
     void report_missing_conditions();
 
     void condition(
@@ -105,32 +183,43 @@ public:
         std::set<std::string> & col_names
     );
 
-    void bin_genesets(ulong slop, ulong max_genes);
+    void prepare_gene_store(bool ranked, const VectorXd & row_norms);
 
-    std::vector<std::vector<ulong> > matched_genesets();
+    void point_gene_matrix();
 
-    std::vector<std::vector<ulong> > random_genesets(int n, ulong slop);
+    void bin_genesets(ulong max_genes);
+
+    std::vector<std::vector<ulong> > matched_genesets(
+        std::mt19937 & generator
+    );
+
+    std::vector<size_t> sample_null_snps(ulong n, std::mt19937 & generator);
+
+    std::vector<std::vector<ulong> > random_genesets(
+        int n,
+        std::mt19937 & generator
+    );
 
     MatrixXd geneset_pvalues_binary(std::vector<ulong> & geneset);
 
     double score_binary_single(
         const ulong & col,
-        const std::vector<std::vector<ulong> > & genesets
+        const std::vector<ulong> & geneset
     );
 
     double score_binary_total(
         const ulong & col,
-        const std::vector<std::vector<ulong> > & genesets
+        const std::vector<ulong> & geneset
     );
 
     double score_quantitative_single(
         const ulong & col,
-        const std::vector<std::vector<ulong> > & genesets
+        const std::vector<ulong> & geneset
     );
 
     double score_quantitative_total(
         const ulong & col,
-        const std::vector<std::vector<ulong> > & genesets
+        const std::vector<ulong> & geneset
     );
 
     void report_scores(
@@ -138,13 +227,63 @@ public:
         const std::unordered_map<std::string, std::vector<ulong> > genesets
     );
 
-    void calculate_pvalues(
-        std::string filename,
-        std::string score_method,
-        std::vector<std::vector<ulong> > genesets,
+    // Score one geneset in a column of the gene matrix.
+    typedef double (snpsea::*score_function)(
+        const ulong & col,
+        const std::vector<ulong> & geneset
+    );
+
+    std::vector<score_function> get_score_functions(
+        const std::vector<std::string> & score_methods
+    );
+
+    double score_genesets(
+        score_function score,
+        const ulong & col,
+        const std::vector<std::vector<ulong> > & genesets
+    );
+
+    std::vector<ulong> count_bins(const std::vector<ulong> & sizes);
+
+    void count_nulls(
+        ulong col,
+        const std::vector<score_function> & score,
+        ulong stream,
+        const std::vector<ulong> & methods,
+        const std::vector<std::vector<ulong> > & bin_counts,
+        const std::vector<std::vector<double> > & scores,
         long min_observations,
         long max_iterations,
-        long replicates
+        std::vector<std::vector<long> > & observed,
+        std::vector<std::vector<long> > & tested
+    );
+
+    void calculate_pvalues(
+        const std::vector<std::string> & folders,
+        const std::vector<std::string> & score_methods,
+        const std::vector<std::vector<std::vector<ulong> > > & genesets,
+        const std::vector<std::vector<ulong> > & bin_counts,
+        long min_observations,
+        long max_iterations
+    );
+
+    void null_pvalues(
+        std::string out_folder,
+        bool write_pvalues,
+        const std::vector<std::string> & score_methods,
+        int n_random_snps,
+        long replicates,
+        long min_observations,
+        long max_iterations
+    );
+
+    void condition_each_pvalues(
+        std::string out_folder,
+        const std::vector<std::string> & score_methods,
+        const ColumnSelection & columns,
+        const std::vector<std::vector<ulong> > & genesets,
+        long min_observations,
+        long max_iterations
     );
 
 private:
@@ -163,16 +302,47 @@ private:
     _condition_names;
 
     // Name of a SNP => genomic interval.
-    std::unordered_map<std::string, genomic_interval>
+    SNPIntervalStore
     _snp_intervals;
 
+    // The genes near SNP i in _snp_intervals are rows
+    // _snp_genes[_snp_gene_offsets[i]] to _snp_genes[_snp_gene_offsets[i+1]]
+    // of the gene matrix.
+    std::vector<ulong>
+    _snp_gene_offsets,
+    _snp_genes;
+
     // Name of a chromosome => interval tree.
     std::unordered_map<std::string, IntervalTree<ulong> >
     _gene_interval_tree;
 
-    MatrixXd
+    // Name of a chromosome => the gene intervals in its tree.
+    std::map<std::string, std::vector<Interval<ulong> > >
+    _gene_intervals;
+
+    // The gene matrix used for scoring. It points to _gene_matrix_data, or
+    // to _gene_store when the matrix does not fit in --max-memory.
+    Map<const MatrixXd>
     _gene_matrix;
 
+    MatrixXd
+    _gene_matrix_data;
+
+    MappedMatrix
+    _gene_store;
+
+    // For --condition-each, the values of every column of the gene matrix
+    // before ranking, their names, and a flag for each column to condition
+    // on.
+    MatrixXd
+    _each_values;
+
+    std::vector<std::string>
+    _each_col_names;
+
+    std::vector<bool>
+    _each_conditions;
+
     // For a binary gene matrix, pre-calculate the column sums and those
     // sums divided by the number of rows.
     VectorXd
@@ -202,6 +372,15 @@ private:
     std::map<ulong, std::vector<std::vector<ulong> > >
     _geneset_bins;
 
+    // Indices in _snp_intervals of the null SNPs that overlap at least one
+    // gene, so random SNPs can be drawn without looking them up.
+    std::vector<size_t>
+    _null_snp_ids;
+
+    // Draws the user's random SNPs.
+    std::mt19937
+    _random_generator;
+
     // Is the first column of the gene matrix filled with 1s and 0s?
     bool
     _binary_gene_matrix;
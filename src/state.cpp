@@ -0,0 +1,452 @@
+// Copyright (c) 2013-2014 Kamil Slowikowski
+// See LICENSE for GPLv3 license.
+
+// Save and load the state that SNPsea prepares before it looks at the
+// user's SNPs, so runs with the same inputs can skip that work.
+//
+// A state file has a 128-byte header followed by sections of 64-bit words.
+// The ranked gene matrix comes first, at offset 128, in column-major order,
+// so the file can be mapped and used without parsing. The header holds a
+// checksum of the sections after the matrix, which is checked on every
+// load, and a checksum of the matrix, which is only checked when the matrix
+// is copied into memory. A matrix left in the file is never read in full.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "snpsea.h"
+
+// The first bytes of a state file, followed by the version number.
+static const char STATE_MAGIC[8] = {
+    'S', 'N', 'P', 'S', 'E', 'A', 'S', 'T'
+};
+static const uint64_t STATE_VERSION = 2;
+
+struct state_header {
+    char magic[8];
+    uint64_t version;
+    // 1 if the gene matrix is binary.
+    uint64_t binary;
+    uint64_t rows;
+    uint64_t cols;
+    // Number of genes with intervals.
+    uint64_t nrows;
+    uint64_t slop;
+    // Hash of the bytes after the gene matrix.
+    uint64_t checksum;
+    // Hash of the gene matrix.
+    uint64_t matrix_checksum;
+    // Zeros, to make the header 128 bytes.
+    uint64_t unused[7];
+};
+
+// Write the sections of a state file and hash them on the way out. Every
+// section is a multiple of 8 bytes, so hashing them one at a time with
+// hash_words() gives the same hash as hashing them all at once.
+class StateWriter
+{
+public:
+    StateWriter(const std::string & filename)
+        : _stream(filename.c_str(), std::ios::binary),
+          _hash(hash_words(NULL, 0)) {}
+
+    void bytes(const void * data, size_t n)
+    {
+        _stream.write((const char *) data, n);
+        _hash = hash_words((const char *) data, n, _hash);
+    }
+
+    void word(uint64_t x)
+    {
+        bytes(&x, sizeof(x));
+    }
+
+    void words(const std::vector<uint64_t> & x)
+    {
+        word(x.size());
+        bytes(x.data(), sizeof(uint64_t) * x.size());
+    }
+
+    // Write a count, a size in bytes, and the strings each ending with
+    // '\0', padded to a multiple of 8 bytes.
+    void strings(const std::vector<std::string> & x)
+    {
+        std::string table;
+        for (const auto & s : x) {
+            table += s + '\0';
+        }
+        uint64_t size = table.size();
+        table.resize((size + 7) / 8 * 8, '\0');
+        word(x.size());
+        word(size);
+        bytes(table.data(), table.size());
+    }
+
+    uint64_t hash() const
+    {
+        return _hash;
+    }
+
+    // Start a new hash for the sections that follow.
+    void reset_hash()
+    {
+        _hash = hash_words(NULL, 0);
+    }
+
+    std::ofstream & stream()
+    {
+        return _stream;
+    }
+
+private:
+    std::ofstream _stream;
+    uint64_t _hash;
+};
+
+// Read the sections of a mapped state file. Any read past the end of the
+// file marks the reader as failed and returns zeros or empty lists.
+class StateReader
+{
+public:
+    StateReader(const char * begin, const char * end)
+        : _pos(begin), _end(end), _ok(true) {}
+
+    bool ok() const
+    {
+        return _ok;
+    }
+
+    const char * bytes(size_t n)
+    {
+        if (!_ok || (size_t) (_end - _pos) < n) {
+            _ok = false;
+            return NULL;
+        }
+        const char * p = _pos;
+        _pos += n;
+        return p;
+    }
+
+    uint64_t word()
+    {
+        const char * p = bytes(sizeof(uint64_t));
+        return p == NULL ? 0 : *(const uint64_t *) p;
+    }
+
+    void words(std::vector<uint64_t> & x)
+    {
+        uint64_t n = word();
+        if (n > (size_t) (_end - _pos) / sizeof(uint64_t)) {
+            _ok = false;
+        }
+        const char * p = bytes(sizeof(uint64_t) * n);
+        x.clear();
+        if (p != NULL) {
+            x.assign((const uint64_t *) p, (const uint64_t *) p + n);
+        }
+    }
+
+    void strings(std::vector<std::string> & x)
+    {
+        uint64_t n = word();
+        uint64_t size = word();
+        const char * p = bytes((size + 7) / 8 * 8);
+        x.clear();
+        if (p == NULL || (size > 0 && p[size - 1] != '\0')) {
+            _ok = false;
+            return;
+        }
+        const char * end = p + size;
+        for (uint64_t i = 0; i < n; i++) {
+            if (p >= end) {
+                _ok = false;
+                return;
+            }
+            size_t length = strlen(p);
+            x.push_back(std::string(p, length));
+            p += length + 1;
+        }
+    }
+
+private:
+    const char * _pos, * _end;
+    bool _ok;
+};
+
+void snpsea::save_state(const std::string & filename, ulong slop)
+{
+    _log << timestamp() << " # Writing \"" + filename + "\" ..."
+         << std::endl;
+
+    state_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+    header.version = STATE_VERSION;
+    header.binary = _binary_gene_matrix;
+    header.rows = _gene_matrix.rows();
+    header.cols = _gene_matrix.cols();
+    header.nrows = _nrows;
+    header.slop = slop;
+
+    // Write the header last, when we know the checksum.
+    StateWriter writer(filename);
+    writer.stream().write((const char *) &header, sizeof(header));
+
+    for (ulong col = 0; col < header.cols; col++) {
+        writer.bytes(
+            _gene_matrix.col(col).data(), sizeof(double) * header.rows
+        );
+        _gene_store.release(col, 1);
+    }
+    header.matrix_checksum = writer.hash();
+    writer.reset_hash();
+    VectorXd sums = VectorXd::Zero(header.cols);
+    if (_binary_gene_matrix) {
+        sums = _binary_sums;
+    }
+    writer.bytes(sums.data(), sizeof(double) * header.cols);
+    writer.strings(_row_names);
+    writer.strings(_col_names);
+
+    // The gene intervals on each chromosome, in the order they were read,
+    // so the interval trees are built the same way.
+    std::vector<std::string> chroms;
+    for (const auto & item : _gene_intervals) {
+        chroms.push_back(item.first);
+    }
+    writer.strings(chroms);
+    for (const auto & item : _gene_intervals) {
+        std::vector<uint64_t> values;
+        for (const auto & interval : item.second) {
+            values.push_back(interval.start);
+            values.push_back(interval.stop);
+            values.push_back(interval.value);
+        }
+        writer.words(values);
+    }
+
+    // The intervals and genesets of the null SNPs.
+    writer.strings(make_vector(_null_snp_names));
+    std::vector<std::string> names;
+    ChromInterner snp_chroms;
+    std::vector<uint64_t> chrom_ids, starts, ends, offsets(1, 0), genes;
+    for (size_t i = 0; i < _snp_intervals.size(); i++) {
+        std::string snp = _snp_intervals.name(i);
+        if (_null_snp_names.count(snp) == 0) {
+            continue;
+        }
+        names.push_back(snp);
+        chrom_ids.push_back(snp_chroms.id(_snp_intervals.chrom(i)));
+        starts.push_back(_snp_intervals.start(i));
+        ends.push_back(_snp_intervals.end(i));
+        genes.insert(
+            genes.end(),
+            _snp_genes.begin() + _snp_gene_offsets[i],
+            _snp_genes.begin() + _snp_gene_offsets[i + 1]
+        );
+        offsets.push_back(genes.size());
+    }
+    chroms.clear();
+    for (uint32_t chrom = 0; chrom < snp_chroms.size(); chrom++) {
+        chroms.push_back(snp_chroms.name(chrom));
+    }
+    writer.strings(names);
+    writer.strings(chroms);
+    writer.words(chrom_ids);
+    writer.words(starts);
+    writer.words(ends);
+    writer.words(offsets);
+    writer.words(genes);
+
+    header.checksum = writer.hash();
+    writer.stream().seekp(0);
+    writer.stream().write((const char *) &header, sizeof(header));
+    writer.stream().close();
+    if (!writer.stream()) {
+        std::cerr << "ERROR: Cannot write " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    _log << timestamp() << " # done." << std::endl;
+}
+
+ulong snpsea::load_state(
+    const std::string & filename,
+    const std::string & snp_intervals_file,
+    ulong max_memory
+)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "ERROR: Cannot open " + filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t map_size = st.st_size;
+    void * map = MAP_FAILED;
+    if (map_size >= sizeof(state_header)) {
+        map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    const char * begin = (const char *) map;
+    const char * end = begin + map_size;
+    const state_header * header = (const state_header *) begin;
+    if (map == MAP_FAILED
+        || memcmp(header->magic, STATE_MAGIC, sizeof(header->magic)) != 0) {
+        std::cerr << "ERROR: Not a SNPsea state file " + filename
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (header->version != STATE_VERSION) {
+        std::cerr << "ERROR: " + filename + " has version "
+                  << header->version << " but this SNPsea reads version "
+                  << STATE_VERSION << ". Save it again." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    // Check the sections after the matrix, without touching the matrix.
+    size_t space = (map_size - sizeof(*header)) / sizeof(double);
+    if (header->cols > 0 && header->rows > space / header->cols) {
+        std::cerr << "ERROR: State file is malformed " + filename
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    ulong matrix_bytes = sizeof(double) * header->rows * header->cols;
+    const char * sections = begin + sizeof(*header) + matrix_bytes;
+    madvise(map, map_size, MADV_SEQUENTIAL);
+    if (hash_words(sections, end - sections) != header->checksum) {
+        std::cerr << "ERROR: Checksum does not match in " + filename
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    StateReader reader(begin + sizeof(*header), end);
+    ulong slop = header->slop;
+    _nrows = header->nrows;
+    _binary_gene_matrix = header->binary != 0;
+    const char * values = reader.bytes(matrix_bytes);
+    const char * sums = reader.bytes(sizeof(double) * header->cols);
+    if (values != NULL && max_memory > 0 && matrix_bytes > max_memory) {
+        // Leave the matrix in the file, where it is already column-major.
+        if (!_gene_store.open(
+                filename, sizeof(*header), header->rows, header->cols
+            )) {
+            std::cerr << "ERROR: Cannot map the gene matrix in " + filename
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _log << timestamp() << " # The gene matrix needs "
+             << matrix_bytes / 1024.0 / 1024.0
+             << " MB, so it is read from " + filename << "." << std::endl;
+    } else if (values != NULL) {
+        // The matrix is read in full to copy it, so check it too.
+        if (hash_words(values, matrix_bytes) != header->matrix_checksum) {
+            std::cerr << "ERROR: Checksum does not match in " + filename
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        _gene_matrix_data = Map<const MatrixXd>(
+            (const double *) values, header->rows, header->cols
+        );
+    }
+    if (_binary_gene_matrix && sums != NULL) {
+        _binary_sums = Map<const VectorXd>((const double *) sums, header->cols);
+        _binary_probs = _binary_sums / _nrows;
+    }
+    reader.strings(_row_names);
+    reader.strings(_col_names);
+
+    std::vector<std::string> chroms;
+    reader.strings(chroms);
+    std::vector<uint64_t> words;
+    // Whether every gene interval has a row of the gene matrix.
+    bool intervals_valid = true;
+    for (const auto & chrom : chroms) {
+        reader.words(words);
+        intervals_valid = intervals_valid && words.size() % 3 == 0;
+        auto & intervals = _gene_intervals[chrom];
+        for (size_t i = 0; i + 2 < words.size(); i += 3) {
+            if (words[i + 2] >= header->rows) {
+                intervals_valid = false;
+                break;
+            }
+            intervals.push_back(
+                Interval<ulong>(words[i], words[i + 1], words[i + 2])
+            );
+        }
+        _gene_interval_tree[chrom] = IntervalTree<ulong>(intervals);
+    }
+
+    std::vector<std::string> null_names, names;
+    reader.strings(null_names);
+    _null_snp_names.insert(null_names.begin(), null_names.end());
+    std::vector<uint64_t> chrom_ids, starts, ends, offsets, genes;
+    reader.strings(names);
+    reader.strings(chroms);
+    reader.words(chrom_ids);
+    reader.words(starts);
+    reader.words(ends);
+    reader.words(offsets);
+    reader.words(genes);
+
+    bool valid = reader.ok()
+                 && intervals_valid
+                 && _row_names.size() == header->rows
+                 && _col_names.size() == header->cols
+                 && chrom_ids.size() == names.size()
+                 && starts.size() == names.size()
+                 && ends.size() == names.size()
+                 && offsets.size() == names.size() + 1
+                 && offsets.back() == genes.size();
+    for (size_t i = 0; valid && i < names.size(); i++) {
+        valid = chrom_ids[i] < chroms.size() && offsets[i] <= offsets[i + 1];
+    }
+    for (size_t k = 0; valid && k < genes.size(); k++) {
+        valid = genes[k] < header->rows;
+    }
+    munmap(map, map_size);
+    if (!valid) {
+        std::cerr << "ERROR: State file is malformed " + filename
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    _log << timestamp() << " # \"" + filename + "\" has "
+         << _row_names.size() << " genes, " << _col_names.size()
+         << " columns and " << names.size() << " null SNPs." << std::endl;
+
+    // Read the intervals of the user's SNPs, then add the null SNPs.
+    if (_user_snp_names.size() > 0) {
+        std::unordered_set<std::string> user_names(
+            _user_snp_names.begin(), _user_snp_names.end()
+        );
+        read_bed_intervals(snp_intervals_file, user_names, _snp_intervals);
+    }
+    for (size_t i = 0; i < names.size(); i++) {
+        _snp_intervals.insert(
+            names[i], chroms[chrom_ids[i]], starts[i], ends[i]
+        );
+    }
+    _snp_intervals.finalize();
+
+    // The null SNPs have their genesets in the state. The user's SNPs are
+    // looked up in the gene interval tree.
+    std::vector<std::vector<ulong> > genesets(_snp_intervals.size());
+    std::vector<bool> found(_snp_intervals.size(), false);
+    for (size_t i = 0; i < names.size(); i++) {
+        size_t j = _snp_intervals.find(names[i]);
+        if (j == SNPIntervalStore::npos) {
+            std::cerr << "ERROR: State file is malformed " + filename
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        genesets[j].assign(
+            genes.begin() + offsets[i], genes.begin() + offsets[i + 1]
+        );
+        found[j] = true;
+    }
+    store_snp_genesets(genesets, found, slop);
+
+    return slop;
+}
@@ -8,8 +8,12 @@
  */
 
 #include "zfstream.h"
+#include "bgzf.h"
+#include <algorithm>        // for max
 #include <cstring>          // for strcpy, strcat, strlen (mode strings)
 #include <cstdio>           // for BUFSIZ
+#include <cstdlib>          // for exit
+#include <iostream>         // for cerr
 
 // Internal buffer sizes (default and "unbuffered" versions)
 #define BIGBUFSIZE BUFSIZ
@@ -20,7 +24,11 @@
 // Default constructor
 gzfilebuf::gzfilebuf()
 : file(NULL), io_mode(std::ios_base::openmode(0)), own_fd(false),
-  buffer(NULL), buffer_size(BIGBUFSIZE), own_buffer(true)
+  buffer(NULL), buffer_size(BIGBUFSIZE), own_buffer(true),
+  ra_size(0), ra_count(0), ra_threads(1), ra_thread(NULL),
+  ra_batch_size(0), ra_batch(0), ra_batch_pending(0), ra_batch_stop(false),
+  ra_filled(0), ra_consumed(0),
+  ra_held(false), ra_done(false), ra_stop(false)
 {
   // No buffers to start with
   this->disable_buffer();
@@ -32,6 +40,7 @@ gzfilebuf::~gzfilebuf()
   // Sync output buffer and close only if responsible for file
   // (i.e. attached streams should be left open at this stage)
   this->sync();
+  this->stop_readahead();
   if (own_fd)
     this->close();
   // Make sure internal buffer is deallocated
@@ -71,6 +80,9 @@ gzfilebuf::open(const char *name,
   this->enable_buffer();
   io_mode = mode;
   own_fd = true;
+  // BGZF blocks can be inflated in parallel
+  if ((mode & std::ios_base::in) && is_bgzf(name))
+    bgzf_name = name;
   return this;
 }
 
@@ -114,6 +126,11 @@ gzfilebuf::close()
   // Attempt to sync and close gzipped file
   if (this->sync() == -1)
     retval = NULL;
+  // The read-ahead thread must be done with the file first
+  this->stop_readahead();
+  ra_size = 0;
+  ra_count = 0;
+  bgzf_name.clear();
   if (gzclose(file) < 0)
     retval = NULL;
   // File is now gone anyway (postcondition [27.8.1.3.8])
@@ -124,6 +141,226 @@ gzfilebuf::close()
   return retval;
 }
 
+// Configure read-ahead buffers
+gzfilebuf*
+gzfilebuf::readahead(std::streamsize size,
+                     int count,
+                     int threads)
+{
+  // Read-ahead only makes sense for files open for reading, and the
+  // buffers cannot change once the thread has started
+  if (!this->is_open() || !(io_mode & std::ios_base::in) || ra_thread)
+    return NULL;
+  ra_size = size;
+  ra_count = count;
+  ra_threads = threads;
+  return this;
+}
+
+// Start inflating on a separate thread
+void
+gzfilebuf::start_readahead()
+{
+  ra_buffers.assign(ra_count, std::vector<char_type>(ra_size));
+  ra_sizes.assign(ra_count, 0);
+  ra_filled = ra_consumed = 0;
+  ra_held = ra_done = ra_stop = false;
+  if (!bgzf_name.empty() && ra_threads > 1)
+  {
+    // Inflate a batch of blocks at once, enough to fill a buffer and to
+    // keep every thread busy. The inflate threads live as long as the
+    // read-ahead thread and take a share of every batch.
+    size_t n_blocks = std::max<size_t>(ra_size / BGZF_MAX_BLOCK_SIZE,
+                                       4 * ra_threads);
+    ra_blocks.assign(n_blocks, std::string());
+    ra_data.assign(n_blocks, std::string());
+    ra_ok.assign(n_blocks, 0);
+    ra_batch_size = 0;
+    ra_batch = 0;
+    ra_batch_pending = 0;
+    ra_batch_stop = false;
+    for (int t = 1; t < ra_threads; ++t)
+      ra_workers.push_back(
+        std::thread(&gzfilebuf::inflate_bgzf_worker, this, t));
+    ra_thread = new std::thread(&gzfilebuf::fill_readahead_bgzf, this);
+  }
+  else
+    ra_thread = new std::thread(&gzfilebuf::fill_readahead, this);
+}
+
+// Wait for a free read-ahead buffer
+bool
+gzfilebuf::wait_for_slot(unsigned long& slot)
+{
+  // A buffer is busy if it is waiting to be read or in the caller's get area
+  std::unique_lock<std::mutex> lock(ra_mutex);
+  while (!ra_stop && ra_filled - ra_consumed + ra_held >= ra_buffers.size())
+    ra_cond.wait(lock);
+  slot = ra_filled % ra_buffers.size();
+  return !ra_stop;
+}
+
+// Hand a filled buffer to the caller
+void
+gzfilebuf::deliver_slot(unsigned long slot,
+                        std::streamsize size)
+{
+  std::lock_guard<std::mutex> lock(ra_mutex);
+  if (size <= 0)
+    ra_done = true;
+  else
+  {
+    ra_sizes[slot] = size;
+    ++ra_filled;
+  }
+  ra_cond.notify_all();
+}
+
+// Body of the read-ahead thread
+void
+gzfilebuf::fill_readahead()
+{
+  unsigned long slot;
+  while (this->wait_for_slot(slot))
+  {
+    // Inflate without holding the lock, so the caller can parse meanwhile
+    int bytes_read = gzread(file, &ra_buffers[slot][0],
+                            ra_buffers[slot].size());
+    this->deliver_slot(slot, bytes_read);
+    if (bytes_read <= 0)
+      return;
+  }
+}
+
+// Inflate blocks t, t + threads, and so on of the current batch
+void
+gzfilebuf::inflate_bgzf_blocks(int t)
+{
+  for (size_t i = t; i < ra_batch_size; i += ra_threads)
+    ra_ok[i] = bgzf_inflate_block(ra_blocks[i], ra_data[i]);
+}
+
+// Body of the inflate threads
+void
+gzfilebuf::inflate_bgzf_worker(int t)
+{
+  unsigned long seen = 0;
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(ra_batch_mutex);
+      while (!ra_batch_stop && ra_batch == seen)
+        ra_batch_cond.wait(lock);
+      if (ra_batch_stop)
+        return;
+      seen = ra_batch;
+    }
+    this->inflate_bgzf_blocks(t);
+    std::lock_guard<std::mutex> lock(ra_batch_mutex);
+    if (--ra_batch_pending == 0)
+      ra_batch_cond.notify_all();
+  }
+}
+
+// Body of the read-ahead thread for BGZF files
+void
+gzfilebuf::fill_readahead_bgzf()
+{
+  FILE* bgzf = fopen(bgzf_name.c_str(), "rb");
+  if (!bgzf)
+  {
+    std::cerr << "ERROR: Cannot open " + bgzf_name << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  while (true)
+  {
+    size_t n = 0;
+    while (n < ra_blocks.size() && bgzf_read_block(bgzf, ra_blocks[n]))
+      ++n;
+
+    // Hand the batch to the inflate threads, take our share, and wait
+    // for theirs
+    {
+      std::lock_guard<std::mutex> lock(ra_batch_mutex);
+      ra_batch_size = n;
+      ra_batch_pending = ra_threads - 1;
+      ++ra_batch;
+      ra_batch_cond.notify_all();
+    }
+    this->inflate_bgzf_blocks(0);
+    {
+      std::unique_lock<std::mutex> lock(ra_batch_mutex);
+      while (ra_batch_pending > 0)
+        ra_batch_cond.wait(lock);
+    }
+
+    std::streamsize size = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (!ra_ok[i])
+      {
+        std::cerr << "ERROR: Corrupt BGZF block in " + bgzf_name
+                  << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      size += ra_data[i].size();
+    }
+    // Skip batches of empty blocks, such as the end-of-file marker
+    if (n > 0 && size == 0)
+      continue;
+
+    unsigned long slot;
+    if (!this->wait_for_slot(slot))
+      break;
+    std::vector<char_type>& buffer = ra_buffers[slot];
+    if ((std::streamsize) buffer.size() < size)
+      buffer.resize(size);
+    char_type* p = size > 0 ? &buffer[0] : NULL;
+    for (size_t i = 0; i < n; ++i)
+    {
+      memcpy(p, ra_data[i].data(), ra_data[i].size());
+      p += ra_data[i].size();
+    }
+    this->deliver_slot(slot, size);
+    if (n == 0)
+      break;
+  }
+  fclose(bgzf);
+}
+
+// Stop the read-ahead thread
+void
+gzfilebuf::stop_readahead()
+{
+  if (!ra_thread)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(ra_mutex);
+    ra_stop = true;
+    ra_cond.notify_all();
+  }
+  ra_thread->join();
+  delete ra_thread;
+  ra_thread = NULL;
+  // The read-ahead thread has finished its last batch, so the inflate
+  // threads are waiting for the next one
+  {
+    std::lock_guard<std::mutex> lock(ra_batch_mutex);
+    ra_batch_stop = true;
+    ra_batch_cond.notify_all();
+  }
+  for (size_t t = 0; t < ra_workers.size(); ++t)
+    ra_workers[t].join();
+  ra_workers.clear();
+  ra_blocks.clear();
+  ra_data.clear();
+  ra_ok.clear();
+  ra_buffers.clear();
+  ra_sizes.clear();
+  // Drop any read-ahead data from the get area
+  this->setg(buffer, buffer, buffer);
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 // Convert int open mode to mode string
@@ -192,6 +429,32 @@ gzfilebuf::underflow()
   if (!this->is_open() || !(io_mode & std::ios_base::in))
     return traits_type::eof();
 
+  // Start the read-ahead thread on the first read
+  if (!ra_thread && ra_size > 0 && ra_count > 0)
+    this->start_readahead();
+
+  // Take the next buffer from the read-ahead thread, handing back the
+  // one the get area used to point into
+  if (ra_thread)
+  {
+    std::unique_lock<std::mutex> lock(ra_mutex);
+    ra_held = false;
+    ra_cond.notify_all();
+    while (ra_filled == ra_consumed && !ra_done)
+      ra_cond.wait(lock);
+    if (ra_filled == ra_consumed)
+    {
+      this->setg(buffer, buffer, buffer);
+      return traits_type::eof();
+    }
+    unsigned long slot = ra_consumed % ra_buffers.size();
+    ++ra_consumed;
+    ra_held = true;
+    char_type* p = &ra_buffers[slot][0];
+    this->setg(p, p, p + ra_sizes[slot]);
+    return traits_type::to_int_type(*(this->gptr()));
+  }
+
   // Attempt to fill internal buffer from gzipped file
   // (buffer must be guaranteed to exist...)
   int bytes_read = gzread(file, buffer, buffer_size);
@@ -370,6 +633,9 @@ gzfilebuf::disable_buffer()
 
 /*****************************************************************************/
 
+// Inflate BGZF files on one thread unless told otherwise
+int gzifstream::default_inflate_threads = 1;
+
 // Default constructor initializes stream buffer
 gzifstream::gzifstream()
 : std::istream(NULL), sb()
@@ -401,7 +667,11 @@ gzifstream::open(const char* name,
   if (!sb.open(name, mode | std::ios_base::in))
     this->setstate(std::ios_base::failbit);
   else
+  {
     this->clear();
+    sb.readahead(default_readahead_size, default_readahead_count,
+                 default_inflate_threads);
+  }
 }
 
 // Attach to file and go into fail() state if unsuccessful
@@ -412,7 +682,21 @@ gzifstream::attach(int fd,
   if (!sb.attach(fd, mode | std::ios_base::in))
     this->setstate(std::ios_base::failbit);
   else
+  {
     this->clear();
+    sb.readahead(default_readahead_size, default_readahead_count,
+                 default_inflate_threads);
+  }
+}
+
+// Change the read-ahead buffers
+void
+gzifstream::readahead(std::streamsize size,
+                      int count,
+                      int threads)
+{
+  if (!sb.readahead(size, count, threads))
+    this->setstate(std::ios_base::failbit);
 }
 
 // Close file
@@ -12,6 +12,11 @@
 
 #include <istream>  // not iostream, since we don't need cin/cout
 #include <ostream>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include "zlib.h"
 
 /*****************************************************************************/
@@ -83,6 +88,28 @@ public:
   gzfilebuf*
   close();
 
+  /**
+   *  @brief  Inflate ahead of the reader on a separate thread.
+   *  @param  size  Size of each read-ahead buffer.
+   *  @param  count  Number of read-ahead buffers.
+   *  @param  threads  Number of threads to inflate BGZF blocks.
+   *  @return  @c this on success, NULL on failure.
+   *
+   *  On the first read after this call, a thread starts to fill a ring
+   *  of @a count buffers of @a size bytes with inflated data, while the
+   *  caller parses the previous ones. A size or count of 0 turns
+   *  read-ahead off. This fails if the file is not open for reading or
+   *  the thread has already started.
+   *
+   *  If the file was opened by name and is BGZF (as written by bgzip),
+   *  its blocks are inflated independently on @a threads threads and
+   *  delivered in order. Other files are inflated by zlib on one thread.
+  */
+  gzfilebuf*
+  readahead(std::streamsize size,
+            int count = 4,
+            int threads = 1);
+
 protected:
   /**
    *  @brief  Convert ios open mode int to mode string used by zlib.
@@ -180,6 +207,69 @@ private:
   void
   disable_buffer();
 
+  /**
+   *  @brief  Allocate read-ahead buffers and start the thread.
+  */
+  void
+  start_readahead();
+
+  /**
+   *  @brief  Stop and join the read-ahead thread, if any.
+  */
+  void
+  stop_readahead();
+
+  /**
+   *  @brief  Fill read-ahead buffers until the end of the file.
+   *
+   *  This is the body of the read-ahead thread.
+  */
+  void
+  fill_readahead();
+
+  /**
+   *  @brief  Fill read-ahead buffers with batches of BGZF blocks
+   *  inflated in parallel.
+   *
+   *  This is the body of the read-ahead thread for BGZF files.
+  */
+  void
+  fill_readahead_bgzf();
+
+  /**
+   *  @brief  Inflate blocks of each batch of a BGZF file.
+   *  @param  t  Index of this worker, from 1 to threads - 1.
+   *
+   *  This is the body of the inflate threads, which wait for a batch,
+   *  inflate their share of it, and wait for the next one.
+  */
+  void
+  inflate_bgzf_worker(int t);
+
+  /**
+   *  @brief  Inflate the share of the current batch for one thread.
+   *  @param  t  Index of the thread: blocks t, t + threads, and so on.
+  */
+  void
+  inflate_bgzf_blocks(int t);
+
+  /**
+   *  @brief  Wait for a read-ahead buffer the caller is done with.
+   *  @param  slot  Set to the index of the free buffer.
+   *  @return  False if the thread should stop.
+  */
+  bool
+  wait_for_slot(unsigned long& slot);
+
+  /**
+   *  @brief  Hand a filled read-ahead buffer to the caller.
+   *  @param  slot  Index of the buffer.
+   *  @param  size  Number of bytes in it, or 0 at the end of the file.
+  */
+  void
+  deliver_slot(unsigned long slot,
+               std::streamsize size);
+
   /**
    *  Underlying file pointer.
   */
@@ -221,6 +311,89 @@ private:
    *  upon destruction.
   */
   bool own_buffer;
+
+  /**
+   *  Size and number of read-ahead buffers, or 0 to read synchronously.
+  */
+  std::streamsize ra_size;
+  int ra_count;
+
+  /**
+   *  Number of threads to inflate BGZF blocks.
+  */
+  int ra_threads;
+
+  /**
+   *  Name of the file if it is BGZF, otherwise empty.
+  */
+  std::string bgzf_name;
+
+  /**
+   *  Thread that inflates into the read-ahead buffers, or NULL.
+  */
+  std::thread* ra_thread;
+
+  /**
+   *  Threads that help the read-ahead thread inflate BGZF blocks.
+  */
+  std::vector<std::thread> ra_workers;
+
+  /**
+   *  Guards the read-ahead counters below.
+  */
+  std::mutex ra_mutex;
+  std::condition_variable ra_cond;
+
+  /**
+   *  @brief  The current batch of BGZF blocks, inflated and whether each
+   *  one is valid.
+   *
+   *  Only the first ra_batch_size blocks belong to the batch.
+  */
+  std::vector<std::string> ra_blocks, ra_data;
+  std::vector<char> ra_ok;
+  size_t ra_batch_size;
+
+  /**
+   *  Guards the batch counters below.
+  */
+  std::mutex ra_batch_mutex;
+  std::condition_variable ra_batch_cond;
+
+  /**
+   *  @brief  Number of batches so far, and the number of workers still
+   *  inflating the current one.
+  */
+  unsigned long ra_batch;
+  int ra_batch_pending;
+
+  /**
+   *  True when the inflate threads should stop.
+  */
+  bool ra_batch_stop;
+
+  /**
+   *  Ring of read-ahead buffers and the number of bytes in each.
+  */
+  std::vector<std::vector<char_type> > ra_buffers;
+  std::vector<std::streamsize> ra_sizes;
+
+  /**
+   *  @brief  Number of buffers filled and consumed so far.
+   *
+   *  Buffer i of the ring holds fill number i, i + count, and so on.
+  */
+  unsigned long ra_filled, ra_consumed;
+
+  /**
+   *  True while the get area points into buffer ra_consumed - 1.
+  */
+  bool ra_held;
+
+  /**
+   *  True when the file is exhausted, or when the thread should stop.
+  */
+  bool ra_done, ra_stop;
 };
 
 /*****************************************************************************/
@@ -255,6 +428,17 @@ public:
   gzifstream(int fd,
              std::ios_base::openmode mode = std::ios_base::in);
 
+  /**
+   *  Default size and number of read-ahead buffers for opened files.
+  */
+  static const std::streamsize default_readahead_size = 1 << 20;
+  static const int default_readahead_count = 4;
+
+  /**
+   *  Number of threads to inflate BGZF files opened after this is set.
+  */
+  static int default_inflate_threads;
+
   /**
    *  Obtain underlying stream buffer.
   */
@@ -297,6 +481,21 @@ public:
   attach(int fd,
          std::ios_base::openmode mode = std::ios_base::in);
 
+  /**
+   *  @brief  Change the read-ahead buffers.
+   *  @param  size  Size of each buffer, or 0 to read on this thread.
+   *  @param  count  Number of buffers.
+   *  @param  threads  Number of threads to inflate BGZF blocks.
+   *
+   *  Files are opened with default_readahead_count buffers of
+   *  default_readahead_size bytes. Call this before reading. Stream
+   *  will be in state fail() if it is not open or reading has started.
+  */
+  void
+  readahead(std::streamsize size,
+            int count = default_readahead_count,
+            int threads = default_inflate_threads);
+
   /**
    *  @brief  Close gzipped file.
    *